@@ -0,0 +1,162 @@
+#include "AllocationTracer.h"
+
+#include <atomic>
+#include <malloc.h>
+#include <new>
+#include <stdlib.h>
+
+namespace GdiWindow
+{
+
+static thread_local uint64_t threadAllocations = 0;
+static std::atomic<uint64_t> totalAllocations(0);
+
+bool AllocationTracer::isEnabled()
+{
+#ifdef GDIWINDOW_TRACE_ALLOCATIONS
+	return true;
+#else
+	return false;
+#endif
+}
+
+uint64_t AllocationTracer::getThreadAllocations()
+{
+	return threadAllocations;
+}
+
+uint64_t AllocationTracer::getTotalAllocations()
+{
+	return totalAllocations.load(std::memory_order_relaxed);
+}
+
+#ifdef GDIWINDOW_TRACE_ALLOCATIONS
+
+static void *tracedAllocate(size_t size)
+{
+	threadAllocations += 1;
+	totalAllocations.fetch_add(1, std::memory_order_relaxed);
+	return malloc(size ? size : 1);
+}
+
+// For over-aligned types. The CRT needs these freed with _aligned_free.
+static void *tracedAllocateAligned(size_t size, std::align_val_t alignment)
+{
+	threadAllocations += 1;
+	totalAllocations.fetch_add(1, std::memory_order_relaxed);
+	return _aligned_malloc(size ? size : 1, size_t(alignment));
+}
+
+#endif
+
+}
+
+#ifdef GDIWINDOW_TRACE_ALLOCATIONS
+
+void *operator new(size_t size)
+{
+	if (void *p = GdiWindow::tracedAllocate(size))
+		return p;
+
+	throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+	return GdiWindow::tracedAllocate(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+	return GdiWindow::tracedAllocate(size);
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept
+{
+	free(p);
+}
+
+void *operator new(size_t size, std::align_val_t alignment)
+{
+	if (void *p = GdiWindow::tracedAllocateAligned(size, alignment))
+		return p;
+
+	throw std::bad_alloc();
+}
+
+void *operator new[](size_t size, std::align_val_t alignment)
+{
+	return operator new(size, alignment);
+}
+
+void *operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+	return GdiWindow::tracedAllocateAligned(size, alignment);
+}
+
+void *operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+	return GdiWindow::tracedAllocateAligned(size, alignment);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept
+{
+	_aligned_free(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept
+{
+	_aligned_free(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept
+{
+	_aligned_free(p);
+}
+
+void operator delete[](void *p, size_t, std::align_val_t) noexcept
+{
+	_aligned_free(p);
+}
+
+void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept
+{
+	_aligned_free(p);
+}
+
+void operator delete[](void *p, std::align_val_t, const std::nothrow_t &) noexcept
+{
+	_aligned_free(p);
+}
+
+#endif
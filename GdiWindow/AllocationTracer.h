@@ -0,0 +1,40 @@
+#pragma once
+
+#include <assert.h>
+#include <inttypes.h>
+
+namespace GdiWindow
+{
+
+// Counts calls to the global operator new when the project is built with
+// GDIWINDOW_TRACE_ALLOCATIONS defined. Without it every count stays zero.
+struct AllocationTracer
+{
+	static bool isEnabled();
+
+	// Allocations made by the calling thread
+	static uint64_t getThreadAllocations();
+
+	// Allocations made by every thread
+	static uint64_t getTotalAllocations();
+};
+
+// Asserts that the calling thread does not allocate while the scope is alive
+struct NoAllocationScope
+{
+	NoAllocationScope(const NoAllocationScope &) = delete;
+
+	NoAllocationScope()
+		: start(AllocationTracer::getThreadAllocations())
+	{
+	}
+
+	~NoAllocationScope()
+	{
+		assert(AllocationTracer::getThreadAllocations() == start && "heap allocation in a no-allocation scope");
+	}
+
+	uint64_t start;
+};
+
+}
@@ -0,0 +1,82 @@
+#include "FrameArena.h"
+
+#include <new>
+#include <stdint.h>
+
+namespace GdiWindow
+{
+
+static const size_t MinBlockSize = 64 * 1024;
+
+static FrameArena::Block *allocateBlock(size_t size)
+{
+	// Through operator new so the allocation tracer sees arena growth
+	FrameArena::Block *block = (FrameArena::Block *)::operator new(sizeof(FrameArena::Block) + size);
+	block->next = nullptr;
+	block->size = size;
+	block->used = 0;
+	return block;
+}
+
+static void freeBlocks(FrameArena::Block *block)
+{
+	while (block)
+	{
+		FrameArena::Block *next = block->next;
+		::operator delete(block);
+		block = next;
+	}
+}
+
+FrameArena::~FrameArena()
+{
+	freeBlocks(current);
+}
+
+void *FrameArena::allocate(size_t size, size_t alignment)
+{
+	assert((alignment & (alignment - 1)) == 0);
+
+	if (current)
+	{
+		uintptr_t base = uintptr_t(current + 1);
+		uintptr_t aligned = (base + current->used + alignment - 1) & ~uintptr_t(alignment - 1);
+		if (aligned + size <= base + current->size)
+		{
+			current->used = aligned + size - base;
+			return (void *)aligned;
+		}
+	}
+
+	size_t blockSize = size + alignment > MinBlockSize ? size + alignment : MinBlockSize;
+	if (blockSize < capacity)
+		blockSize = capacity;
+
+	Block *block = allocateBlock(blockSize);
+	block->next = current;
+	if (current)
+		used += current->used;
+
+	current = block;
+	capacity += blockSize;
+	return allocate(size, alignment);
+}
+
+void FrameArena::reset()
+{
+	if (current && current->next)
+	{
+		// Replace the chain with one block big enough for the whole frame
+		size_t total = capacity;
+		freeBlocks(current);
+		current = allocateBlock(total);
+		capacity = total;
+	}
+
+	if (current)
+		current->used = 0;
+
+	used = 0;
+}
+
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+
+namespace GdiWindow
+{
+
+// Bump allocator for data that lives until the end of a frame. Reset keeps
+// the memory, and if a frame needed more than one block they are merged into
+// one, so a steady workload stops touching the heap after the first frames.
+// Destructors of objects placed in the arena are never run.
+struct FrameArena
+{
+	FrameArena() {}
+	FrameArena(const FrameArena &) = delete;
+	FrameArena &operator=(const FrameArena &) = delete;
+	~FrameArena();
+
+	void *allocate(size_t size, size_t alignment = 16);
+
+	template<typename T>
+	T *allocateArray(size_t count)
+	{
+		return (T *)allocate(sizeof(T) * count, alignof(T) > 16 ? alignof(T) : 16);
+	}
+
+	void reset();
+
+	size_t getUsed() const { return used + (current ? current->used : 0); }
+	size_t getCapacity() const { return capacity; }
+
+	struct Block
+	{
+		Block *next;
+		size_t size;
+		size_t used;
+	};
+
+	Block *current = nullptr;
+
+	// Totals of the blocks behind current
+	size_t used = 0;
+	size_t capacity = 0;
+};
+
+// Growable array in a FrameArena for trivially copyable types. Growing
+// leaves the old storage behind until the arena is reset.
+template<typename T>
+struct ArenaArray
+{
+	void reset()
+	{
+		data = nullptr;
+		size = 0;
+		capacity = 0;
+	}
+
+	void push(FrameArena &arena, const T &value)
+	{
+		if (size == capacity)
+		{
+			int newCapacity = capacity ? capacity * 2 : 16;
+			T *newData = arena.allocateArray<T>(newCapacity);
+			if (size)
+				memcpy(newData, data, sizeof(T) * size);
+			data = newData;
+			capacity = newCapacity;
+		}
+
+		data[size++] = value;
+	}
+
+	void pop()
+	{
+		assert(size > 0);
+		--size;
+	}
+
+	T &back()
+	{
+		assert(size > 0);
+		return data[size - 1];
+	}
+
+	const T &back() const
+	{
+		assert(size > 0);
+		return data[size - 1];
+	}
+
+	T &operator[](int i) { return data[i]; }
+	const T &operator[](int i) const { return data[i]; }
+
+	bool empty() const { return size == 0; }
+
+	T *data = nullptr;
+	int size = 0;
+	int capacity = 0;
+};
+
+}
@@ -0,0 +1,274 @@
+#include "FrameCapture.h"
+
+#include "GdiKernels.h"
+#include "Guard.h"
+#include "Trace.h"
+#include "WorkerThreads.h"
+
+#include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <string.h>
+#include <vector>
+
+namespace GdiWindow
+{
+
+static const size_t MaxPooledBuffers = 8;
+
+enum class CaptureState
+{
+	Pending,
+	Converting,
+	Ready,
+	Cancelled,
+};
+
+static void releaseBuffer(std::vector<uint32_t> &&buffer);
+
+struct CaptureRequest
+{
+	~CaptureRequest()
+	{
+		releaseBuffer(std::move(pixels));
+	}
+
+	std::mutex m;
+	std::condition_variable cv;
+	CaptureState state = CaptureState::Pending;
+	CapturedFrame frame;
+
+	// Only touched by the thread that moves the request out of Pending or
+	// Converting, so the worker can convert without holding m
+	std::vector<uint32_t> pixels;
+};
+
+typedef std::vector<std::shared_ptr<CaptureRequest>> CaptureRequests;
+
+static Ref<std::vector<std::vector<uint32_t>>> getBufferPool()
+{
+	static Guard<std::vector<std::vector<uint32_t>>> pool;
+	return pool;
+}
+
+// Reuses a pooled buffer that is already big enough, so a steady capture
+// rate does not allocate
+static std::vector<uint32_t> acquireBuffer(size_t count)
+{
+	std::vector<uint32_t> buffer;
+	{
+		Ref<std::vector<std::vector<uint32_t>>> pool = getBufferPool();
+		for (size_t i = 0; i < pool->size(); ++i)
+		{
+			if ((*pool.t)[i].capacity() >= count)
+			{
+				buffer.swap((*pool.t)[i]);
+				(*pool.t)[i].swap(pool->back());
+				pool->pop_back();
+				break;
+			}
+		}
+	}
+
+	buffer.resize(count);
+	return buffer;
+}
+
+static void releaseBuffer(std::vector<uint32_t> &&buffer)
+{
+	if (buffer.capacity() == 0)
+		return;
+
+	Ref<std::vector<std::vector<uint32_t>>> pool = getBufferPool();
+	if (pool->size() < MaxPooledBuffers)
+		pool->push_back(std::move(buffer));
+}
+
+static Ref<std::map<void *, CaptureRequests>> getPendingMap()
+{
+	static Guard<std::map<void *, CaptureRequests>> map;
+	return map;
+}
+
+// Lets submit skip the map lock while nobody is waiting for a frame
+static std::atomic<int> pendingCount(0);
+
+static void complete(CaptureRequest &request, CaptureState state)
+{
+	{
+		std::lock_guard<std::mutex> lock(request.m);
+		request.state = state;
+		if (state == CaptureState::Ready)
+			request.frame.pixels = request.pixels.data();
+	}
+	request.cv.notify_all();
+}
+
+// Flips the rows and swaps red and blue in place
+static void convertToTopDownRgba(CaptureRequest &request)
+{
+	static thread_local std::vector<uint32_t> scratch;
+
+	const KernelTable &kernels = GdiKernels::get();
+	int w = request.frame.w;
+	int h = request.frame.h;
+	scratch.resize(size_t(w));
+
+	uint32_t *pixels = request.pixels.data();
+	int top = 0;
+	int bottom = h - 1;
+	for (; top < bottom; ++top, --bottom)
+	{
+		uint32_t *topRow = pixels + size_t(top) * w;
+		uint32_t *bottomRow = pixels + size_t(bottom) * w;
+		kernels.blit(scratch.data(), topRow, w);
+		kernels.swapRedBlue(topRow, bottomRow, w);
+		kernels.swapRedBlue(bottomRow, scratch.data(), w);
+	}
+
+	if (top == bottom)
+		kernels.swapRedBlue(pixels + size_t(top) * w, pixels + size_t(top) * w, w);
+}
+
+struct ConvertQueue
+{
+	std::deque<std::shared_ptr<CaptureRequest>> queue;
+	std::condition_variable changed;
+	bool started = false;
+};
+
+static Guard<ConvertQueue> &getConvertQueue()
+{
+	return getWorkerState<ConvertQueue>();
+}
+
+static void convertThread()
+{
+	Trace::setThreadName("Capture conversion");
+
+	Guard<ConvertQueue> &queue = getConvertQueue();
+	std::unique_lock<std::mutex> lock(queue.m);
+	while (true)
+	{
+		queue.t.changed.wait(lock, [&queue] { return !queue.t.queue.empty(); });
+
+		std::shared_ptr<CaptureRequest> request = std::move(queue.t.queue.front());
+		queue.t.queue.pop_front();
+
+		lock.unlock();
+		convertToTopDownRgba(*request);
+		complete(*request, CaptureState::Ready);
+		request.reset();
+		lock.lock();
+	}
+}
+
+static void queueConversion(std::shared_ptr<CaptureRequest> &&request)
+{
+	Ref<ConvertQueue> queue = getConvertQueue();
+	queue->queue.push_back(std::move(request));
+	queue->changed.notify_one();
+
+	WorkerThreads::start(queue->started, 1, &convertThread);
+}
+
+bool CaptureHandle::isReady() const
+{
+	if (!request)
+		return false;
+
+	std::lock_guard<std::mutex> lock(request->m);
+	return request->state == CaptureState::Ready || request->state == CaptureState::Cancelled;
+}
+
+const CapturedFrame *CaptureHandle::wait(uint32_t timeoutMs)
+{
+	if (!request)
+		return nullptr;
+
+	auto isDone = [this] { return request->state == CaptureState::Ready || request->state == CaptureState::Cancelled; };
+
+	std::unique_lock<std::mutex> lock(request->m);
+	if (timeoutMs == 0xffffffff)
+		request->cv.wait(lock, isDone);
+	else if (!request->cv.wait_for(lock, std::chrono::milliseconds(timeoutMs), isDone))
+		return nullptr;
+
+	return request->state == CaptureState::Ready ? &request->frame : nullptr;
+}
+
+CaptureHandle FrameCapture::request(void *hwnd, CaptureFormat format)
+{
+	CaptureHandle handle;
+	handle.request = std::make_shared<CaptureRequest>();
+	handle.request->frame.format = format;
+
+	Ref<std::map<void *, CaptureRequests>> map = getPendingMap();
+	(*map.t)[hwnd].push_back(handle.request);
+	pendingCount.fetch_add(1, std::memory_order_relaxed);
+	return handle;
+}
+
+void FrameCapture::cancel(void *hwnd)
+{
+	CaptureRequests requests;
+	{
+		Ref<std::map<void *, CaptureRequests>> map = getPendingMap();
+		auto it = map->find(hwnd);
+		if (it == map->end())
+			return;
+
+		requests.swap(it->second);
+		map->erase(it);
+		pendingCount.fetch_sub(int(requests.size()), std::memory_order_relaxed);
+	}
+
+	for (std::shared_ptr<CaptureRequest> &request : requests)
+		complete(*request, CaptureState::Cancelled);
+}
+
+void FrameCapture::submit(void *hwnd, const unsigned char *buffer, int w, int h)
+{
+	if (!buffer || pendingCount.load(std::memory_order_relaxed) == 0)
+		return;
+
+	CaptureRequests requests;
+	{
+		Ref<std::map<void *, CaptureRequests>> map = getPendingMap();
+		auto it = map->find(hwnd);
+		if (it == map->end())
+			return;
+
+		requests.swap(it->second);
+		pendingCount.fetch_sub(int(requests.size()), std::memory_order_relaxed);
+	}
+
+	// The DIB has no row padding at 32 bpp, so the frame is one block copy.
+	// Anything slower happens on the worker.
+	size_t count = size_t(w) * size_t(h);
+	for (std::shared_ptr<CaptureRequest> &request : requests)
+	{
+		request->pixels = acquireBuffer(count);
+		memcpy(request->pixels.data(), buffer, count * sizeof(uint32_t));
+		request->frame.w = w;
+		request->frame.h = h;
+
+		if (request->frame.format == CaptureFormat::TopDownRgba)
+		{
+			{
+				std::lock_guard<std::mutex> lock(request->m);
+				request->state = CaptureState::Converting;
+			}
+			queueConversion(std::move(request));
+		}
+		else
+		{
+			complete(*request, CaptureState::Ready);
+		}
+	}
+}
+
+}
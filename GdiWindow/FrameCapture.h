@@ -0,0 +1,66 @@
+#pragma once
+
+#include <inttypes.h>
+#include <memory>
+
+namespace GdiWindow
+{
+
+enum class CaptureFormat
+{
+	// The window buffer as presented: bottom-up rows of BGRA
+	BottomUpBgra,
+
+	// Top-down rows of RGBA, converted on a worker thread
+	TopDownRgba,
+};
+
+struct CapturedFrame
+{
+	CaptureFormat format = CaptureFormat::BottomUpBgra;
+	int w = 0;
+	int h = 0;
+
+	// w * h pixels with no row padding, valid while the handle is alive
+	const uint32_t *pixels = nullptr;
+};
+
+struct CaptureRequest;
+
+// Future-like handle to a frame requested with GdiDraw::captureAsync. The
+// pixels live in a pooled buffer that goes back to the pool when the handle
+// is destroyed.
+struct CaptureHandle
+{
+	CaptureHandle() {}
+	CaptureHandle(const CaptureHandle &) = delete;
+	CaptureHandle(CaptureHandle &&o) = default;
+	CaptureHandle &operator=(CaptureHandle &&o) = default;
+
+	bool isValid() const { return !!request; }
+
+	// True once the frame is copied and converted, or the capture was cancelled
+	bool isReady() const;
+
+	// Blocks for up to timeoutMs. Returns the frame, or nullptr if the capture
+	// was cancelled or did not complete in time.
+	const CapturedFrame *wait(uint32_t timeoutMs = 0xffffffff);
+
+	std::shared_ptr<CaptureRequest> request;
+};
+
+struct FrameCapture
+{
+	// Queues a capture of the next frame paint presents for hwnd
+	static CaptureHandle request(void *hwnd, CaptureFormat format);
+
+	// Completes every pending capture for hwnd as cancelled
+	static void cancel(void *hwnd);
+
+	// Called by GdiDraw::paint with the bottom-up buffer that was just
+	// presented, after the window state lock is released. Costs one copy per
+	// pending capture and nothing otherwise.
+	static void submit(void *hwnd, const unsigned char *buffer, int w, int h);
+};
+
+}
@@ -0,0 +1,378 @@
+#include "FrameRecorder.h"
+
+#include "GdiKernels.h"
+#include "Guard.h"
+#include "Trace.h"
+
+#include <assert.h>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <string.h>
+#include <thread>
+
+namespace GdiWindow
+{
+
+static const uint32_t FileMagic = 0x43524447; // "GDRC"
+static const uint32_t FileVersion = 1;
+static const uint32_t ChunkMagic = 0x4d524647; // "GFRM"
+static const uint32_t KeyFrameFlag = 1;
+
+struct FileHeader
+{
+	uint32_t magic;
+	uint32_t version;
+};
+
+struct ChunkHeader
+{
+	uint32_t magic;
+	uint32_t frameNumber;
+	uint64_t timeUs;
+	uint32_t w;
+	uint32_t h;
+	uint32_t flags;
+	uint32_t encodedWords;
+};
+
+// Frames are XORed against the previous frame and the delta is stored as
+// alternating runs: [zero count][literal count][literal pixels...]
+static void encodeDelta(const uint32_t *current, const uint32_t *previous, size_t count, std::vector<uint32_t> &out)
+{
+	out.clear();
+
+	size_t i = 0;
+	while (i < count)
+	{
+		size_t zeroStart = i;
+		while (i < count && current[i] == previous[i])
+			++i;
+
+		size_t literalStart = i;
+		while (i < count && current[i] != previous[i])
+		{
+			// Stop a literal run at the first pair of unchanged pixels so short
+			// gaps don't cost a new run header each.
+			if (i + 1 < count && current[i + 1] == previous[i + 1] && (i + 2 >= count || current[i + 2] == previous[i + 2]))
+			{
+				++i;
+				break;
+			}
+			++i;
+		}
+
+		out.push_back(uint32_t(literalStart - zeroStart));
+		out.push_back(uint32_t(i - literalStart));
+		for (size_t j = literalStart; j < i; ++j)
+			out.push_back(current[j] ^ previous[j]);
+	}
+}
+
+static bool decodeDelta(const uint32_t *encoded, size_t encodedCount, uint32_t *pixels, size_t count)
+{
+	size_t e = 0;
+	size_t i = 0;
+	while (e + 2 <= encodedCount)
+	{
+		uint32_t zeros = encoded[e++];
+		uint32_t literals = encoded[e++];
+		if (i + zeros + literals > count || e + literals > encodedCount)
+			return false;
+
+		i += zeros;
+		for (uint32_t j = 0; j < literals; ++j)
+			pixels[i++] ^= encoded[e++];
+	}
+
+	return e == encodedCount;
+}
+
+struct RecorderSlot
+{
+	std::vector<uint32_t> pixels;
+	uint32_t frameNumber = 0;
+	uint64_t timeUs = 0;
+	int w = 0;
+	int h = 0;
+};
+
+struct Recorder
+{
+	static const int SlotCount = 4;
+
+	FILE *file = nullptr;
+	std::thread writer;
+	std::chrono::steady_clock::time_point startTime;
+
+	std::mutex m;
+	std::condition_variable cv;
+	RecorderSlot slots[SlotCount];
+	int freeSlots[SlotCount];
+	int freeCount = 0;
+	int readySlots[SlotCount];
+	int readyCount = 0;
+	bool stopping = false;
+	uint32_t frameNumber = 0;
+	FrameRecorderStats stats;
+
+	// Only touched by the writer thread
+	std::vector<uint32_t> previous;
+	std::vector<uint32_t> encoded;
+	int previousW = 0;
+	int previousH = 0;
+};
+
+// Shared so a submit that already found its recorder can finish copying
+// after stop() has let go of it
+typedef std::map<void *, std::shared_ptr<Recorder>> RecorderMap;
+
+static Ref<RecorderMap> getRecorderMap()
+{
+	static Guard<RecorderMap> map;
+	return map;
+}
+
+static void writeFrame(Recorder &recorder, RecorderSlot &slot)
+{
+	size_t count = size_t(slot.w) * size_t(slot.h);
+
+	bool keyFrame = slot.w != recorder.previousW || slot.h != recorder.previousH;
+	if (keyFrame)
+	{
+		recorder.previous.assign(count, 0);
+		recorder.previousW = slot.w;
+		recorder.previousH = slot.h;
+	}
+
+	encodeDelta(slot.pixels.data(), recorder.previous.data(), count, recorder.encoded);
+	memcpy(recorder.previous.data(), slot.pixels.data(), count * sizeof(uint32_t));
+
+	ChunkHeader header;
+	header.magic = ChunkMagic;
+	header.frameNumber = slot.frameNumber;
+	header.timeUs = slot.timeUs;
+	header.w = uint32_t(slot.w);
+	header.h = uint32_t(slot.h);
+	header.flags = keyFrame ? KeyFrameFlag : 0;
+	header.encodedWords = uint32_t(recorder.encoded.size());
+
+	fwrite(&header, sizeof(header), 1, recorder.file);
+	fwrite(recorder.encoded.data(), sizeof(uint32_t), recorder.encoded.size(), recorder.file);
+
+	std::lock_guard<std::mutex> lock(recorder.m);
+	recorder.stats.recorded += 1;
+	recorder.stats.bytesWritten += sizeof(header) + recorder.encoded.size() * sizeof(uint32_t);
+}
+
+static void writerThread(Recorder *recorder)
+{
+	Trace::setThreadName("Frame recorder");
+
+	std::unique_lock<std::mutex> lock(recorder->m);
+	while (true)
+	{
+		recorder->cv.wait(lock, [recorder] { return recorder->readyCount > 0 || recorder->stopping; });
+
+		if (recorder->readyCount == 0)
+			break;
+
+		int slotIndex = recorder->readySlots[0];
+		recorder->readyCount -= 1;
+		memmove(recorder->readySlots, recorder->readySlots + 1, recorder->readyCount * sizeof(int));
+
+		lock.unlock();
+		writeFrame(*recorder, recorder->slots[slotIndex]);
+		lock.lock();
+
+		recorder->freeSlots[recorder->freeCount++] = slotIndex;
+	}
+
+	fflush(recorder->file);
+}
+
+bool FrameRecorder::start(void *hwnd, const char *path)
+{
+	Ref<RecorderMap> map = getRecorderMap();
+	if (map->find(hwnd) != map->end())
+		return false;
+
+	FILE *file = nullptr;
+	if (fopen_s(&file, path, "wb") != 0 || !file)
+		return false;
+
+	FileHeader header;
+	header.magic = FileMagic;
+	header.version = FileVersion;
+	fwrite(&header, sizeof(header), 1, file);
+
+	std::shared_ptr<Recorder> recorder = std::make_shared<Recorder>();
+	recorder->file = file;
+	recorder->startTime = std::chrono::steady_clock::now();
+	for (int i = 0; i < Recorder::SlotCount; ++i)
+		recorder->freeSlots[recorder->freeCount++] = i;
+
+	recorder->writer = std::thread(writerThread, recorder.get());
+	map->operator[](hwnd) = recorder;
+	return true;
+}
+
+void FrameRecorder::stop(void *hwnd)
+{
+	std::shared_ptr<Recorder> recorder;
+	{
+		Ref<RecorderMap> map = getRecorderMap();
+		auto it = map->find(hwnd);
+		if (it == map->end())
+			return;
+
+		recorder = it->second;
+		map->erase(it);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(recorder->m);
+		recorder->stopping = true;
+	}
+	recorder->cv.notify_one();
+	recorder->writer.join();
+
+	fclose(recorder->file);
+	recorder->file = nullptr;
+}
+
+bool FrameRecorder::isRecording(void *hwnd)
+{
+	Ref<RecorderMap> map = getRecorderMap();
+	return map->find(hwnd) != map->end();
+}
+
+FrameRecorderStats FrameRecorder::getStats(void *hwnd)
+{
+	Ref<RecorderMap> map = getRecorderMap();
+	auto it = map->find(hwnd);
+	if (it == map->end())
+		return FrameRecorderStats();
+
+	std::lock_guard<std::mutex> lock(it->second->m);
+	return it->second->stats;
+}
+
+void FrameRecorder::submit(void *hwnd, const unsigned char *buffer, int w, int h)
+{
+	std::shared_ptr<Recorder> recorderRef;
+	{
+		Ref<RecorderMap> map = getRecorderMap();
+		auto it = map->find(hwnd);
+		if (it == map->end())
+			return;
+
+		recorderRef = it->second;
+	}
+
+	// The copy runs without the registry lock. A slot handed over after
+	// stop() joined the writer is never written.
+	Recorder &recorder = *recorderRef;
+
+	int slotIndex = -1;
+	uint32_t frameNumber = 0;
+	{
+		std::lock_guard<std::mutex> lock(recorder.m);
+		frameNumber = recorder.frameNumber++;
+		if (recorder.freeCount == 0)
+		{
+			recorder.stats.dropped += 1;
+			return;
+		}
+		slotIndex = recorder.freeSlots[--recorder.freeCount];
+	}
+
+	RecorderSlot &slot = recorder.slots[slotIndex];
+	slot.pixels.resize(size_t(w) * size_t(h));
+	slot.frameNumber = frameNumber;
+	slot.timeUs = uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - recorder.startTime).count());
+	slot.w = w;
+	slot.h = h;
+
+	// Flip the bottom-up DIB rows so the stream is top-down
+	const KernelTable &kernels = GdiKernels::get();
+	const uint32_t *src = (const uint32_t *)buffer;
+	for (int y = 0; y < h; ++y)
+		kernels.blit(&slot.pixels[size_t(y) * w], src + size_t(h - 1 - y) * w, w);
+
+	{
+		std::lock_guard<std::mutex> lock(recorder.m);
+		recorder.readySlots[recorder.readyCount++] = slotIndex;
+	}
+	recorder.cv.notify_one();
+}
+
+FrameReader::~FrameReader()
+{
+	close();
+}
+
+bool FrameReader::open(const char *path)
+{
+	close();
+
+	if (fopen_s(&file, path, "rb") != 0 || !file)
+	{
+		file = nullptr;
+		return false;
+	}
+
+	FileHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != FileMagic || header.version != FileVersion)
+	{
+		close();
+		return false;
+	}
+
+	return true;
+}
+
+void FrameReader::close()
+{
+	if (file)
+		fclose(file);
+
+	file = nullptr;
+	pixels.clear();
+}
+
+bool FrameReader::next(RecordedFrame &frame)
+{
+	if (!file)
+		return false;
+
+	ChunkHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != ChunkMagic)
+		return false;
+
+	encoded.resize(header.encodedWords);
+	if (fread(encoded.data(), sizeof(uint32_t), encoded.size(), file) != encoded.size())
+		return false;
+
+	size_t count = size_t(header.w) * size_t(header.h);
+	bool keyFrame = (header.flags & KeyFrameFlag) != 0;
+	if (keyFrame)
+		pixels.assign(count, 0);
+	else if (pixels.size() != count)
+		return false;
+
+	if (!decodeDelta(encoded.data(), encoded.size(), pixels.data(), count))
+		return false;
+
+	frame.frameNumber = header.frameNumber;
+	frame.timeUs = header.timeUs;
+	frame.encodedBytes = uint32_t(sizeof(header) + encoded.size() * sizeof(uint32_t));
+	frame.keyFrame = keyFrame;
+	frame.w = int(header.w);
+	frame.h = int(header.h);
+	frame.pixels = pixels.data();
+	return true;
+}
+
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <vector>
+
+namespace GdiWindow
+{
+
+struct FrameRecorderStats
+{
+	uint64_t recorded = 0;
+	uint64_t dropped = 0;
+	uint64_t bytesWritten = 0;
+};
+
+struct FrameRecorder
+{
+	static bool start(void *hwnd, const char *path);
+	static void stop(void *hwnd);
+	static bool isRecording(void *hwnd);
+	static FrameRecorderStats getStats(void *hwnd);
+
+	// Called by GdiDraw::paint with the bottom-up buffer that was just presented.
+	// Never waits for the writer; the frame is dropped if no slot is free.
+	static void submit(void *hwnd, const unsigned char *buffer, int w, int h);
+};
+
+struct RecordedFrame
+{
+	uint32_t frameNumber = 0;
+	uint64_t timeUs = 0;
+	uint32_t encodedBytes = 0;
+	bool keyFrame = false;
+	int w = 0;
+	int h = 0;
+
+	// Top-down BGRA, valid until the next call to FrameReader::next.
+	const uint32_t *pixels = nullptr;
+};
+
+struct FrameReader
+{
+	FrameReader() {}
+	FrameReader(const FrameReader &) = delete;
+	~FrameReader();
+
+	bool open(const char *path);
+	void close();
+	bool next(RecordedFrame &frame);
+
+	FILE *file = nullptr;
+	std::vector<uint32_t> pixels;
+	std::vector<uint32_t> encoded;
+};
+
+}
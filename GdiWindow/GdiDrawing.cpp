@@ -1,6 +1,16 @@
 #include "GdiDrawing.h"
 
 #include "Guard.h"
+#include "FrameArena.h"
+#include "FrameCapture.h"
+#include "FrameRecorder.h"
+#include "GdiKernels.h"
+#include "HitIndex.h"
+#include "ImageFilters.h"
+#include "PixelPipeline.h"
+#include "SharedFrame.h"
+#include "Trace.h"
+#include "TriangleRasterizer.h"
 
 #include <assert.h>
 #include <Windows.h>
@@ -8,204 +18,1732 @@
 #include <vcruntime_string.h>
 #include <inttypes.h>
 #include <malloc.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <map>
+#include <math.h>
+#include <string>
+#include <vector>
 
 namespace GdiWindow
 {
+struct DirtyRect
+{
+	int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+
+	void add(int x, int y, int w, int h)
+	{
+		if (w <= 0 || h <= 0)
+			return;
+
+		if (x1 <= x0 || y1 <= y0)
+		{
+			x0 = x; y0 = y; x1 = x + w; y1 = y + h;
+			return;
+		}
+
+		x0 = x < x0 ? x : x0;
+		y0 = y < y0 ? y : y0;
+		x1 = x + w > x1 ? x + w : x1;
+		y1 = y + h > y1 ? y + h : y1;
+	}
+};
+
+static const int ScaleOne = 1 << 16;
+
+// Integer translation and 16.16 fixed-point uniform scale, mapping the
+// caller's coordinates to pixels: pixel = t + v * scale
+struct Transform
+{
+	int tx = 0;
+	int ty = 0;
+	int scale = ScaleOne;
+
+	float x(float v) const { return float(tx) + v * float(scale) * (1.0f / ScaleOne); }
+	float y(float v) const { return float(ty) + v * float(scale) * (1.0f / ScaleOne); }
+	float length(float v) const { return v * float(scale) * (1.0f / ScaleOne); }
+};
+
+// Offscreen premultiplied BGRA, top-down, the size of the draw buffer
+struct Layer
+{
+	int id = 0;
+	int zOrder = 0;
+	uint32_t opacity = 255;
+	Vec2 offset;
+	bool visible = true;
+	bool changed = true;
+
+	std::vector<uint32_t> pixels;
+
+	// Recorded when the layer was last drawn, without its offset
+	std::vector<HitShape> hitShapes;
+};
+
 struct WindowState
 {
-	HWND hwnd = nullptr;
-	unsigned char *buffer = nullptr;
-	HDC hDibDC;
-	HGDIOBJ hgdiobj;
-	int h = 0;
-	int w = 0;
-};
+	HWND hwnd = nullptr;
+	unsigned char *buffer = nullptr;
+	HDC hDibDC;
+	HGDIOBJ hgdiobj;
+	HBITMAP hDib = nullptr;
+	int h = 0;
+	int w = 0;
+
+	DirtyRect dirty;
+
+	// Sorted by zOrder. While a layer is begun, drawing goes to it instead of
+	// the buffer.
+	std::vector<Layer> layers;
+	int nextLayerId = 1;
+	int activeLayer = 0;
+	bool composeNeeded = false;
+
+	// Dynamic resolution. While drawW x drawH is smaller than the window,
+	// drawing goes to scaledBuffer and endDrawing upscales it into the
+	// buffer. scaledBuffer is sized for the whole window when scaling is
+	// turned on, so changing the scale never allocates.
+	float renderScale = 1;
+	ScaleFilter scaleFilter = ScaleFilter::Bilinear;
+	int drawW = 0;
+	int drawH = 0;
+	std::vector<uint32_t> scaledBuffer;
+
+	// Render scale controller, off while targetFrameMs is zero
+	float targetFrameMs = 0;
+	float averageFrameMs = 0;
+	int framesSinceScaleChange = 0;
+	std::chrono::steady_clock::time_point frameStart;
+
+	// Hit testing. Primitives drawn to the buffer are recorded while hitId
+	// is set; endDrawing indexes them, or the layers' shapes, for hitTest.
+	// hitScale maps window pixels to draw pixels for the indexed frame.
+	uint32_t hitId = 0;
+	std::vector<HitShape> frameHitShapes;
+	HitIndex hitIndex;
+	float hitScale = 1;
+
+	// Drawing session state, reset by beginDrawing. Lives in the frame arena,
+	// which endDrawing resets.
+	FrameArena arena;
+	ArenaArray<IntRect> clipStack;
+	ArenaArray<Transform> transformStack;
+
+	std::string sharedName;
+	HANDLE hMapping = nullptr;
+	SharedFrameHeader *sharedHeader = nullptr;
+
+	// Hidden windows, and windows evicted to keep within the framebuffer
+	// budget, have no buffers and drawing to them does nothing. A hidden
+	// window gets them back when shown, an evicted one at its next
+	// beginDrawing. A window that is hidden while drawing keeps its buffer
+	// until endDrawing.
+	bool visible = true;
+	bool evicted = false;
+	bool releasePending = false;
+	std::chrono::steady_clock::time_point lastUsed;
+};
+
+// The DIB of a released buffer, kept for the next window of the same size
+struct PooledDib
+{
+	HBITMAP hDib = nullptr;
+	unsigned char *buffer = nullptr;
+	int w = 0;
+	int h = 0;
+	std::chrono::steady_clock::time_point released;
+};
+
+static const uint32_t SharedPixelOffset = 4096;
+
+static Layer *findLayer(WindowState &state, int id)
+{
+	for (Layer &layer : state.layers)
+	{
+		if (layer.id == id)
+			return &layer;
+	}
+
+	return nullptr;
+}
+
+static void sortLayers(WindowState &state)
+{
+	std::stable_sort(state.layers.begin(), state.layers.end(),
+		[](const Layer &a, const Layer &b) { return a.zOrder < b.zOrder; });
+}
+
+static Surface getBufferSurface(WindowState &state)
+{
+	Surface surface;
+	surface.w = state.w;
+	surface.h = state.h;
+	surface.stride = -state.w;
+	surface.pixels = (uint32_t *)state.buffer + ptrdiff_t(state.h - 1) * state.w;
+	return surface;
+}
+
+static bool isScaled(const WindowState &state)
+{
+	return state.drawW != state.w || state.drawH != state.h;
+}
+
+// The window buffer, or the smaller buffer that is upscaled into it
+static Surface getDrawBufferSurface(WindowState &state)
+{
+	if (!isScaled(state))
+		return getBufferSurface(state);
+
+	Surface surface;
+	surface.w = state.drawW;
+	surface.h = state.drawH;
+	surface.stride = state.drawW;
+	surface.pixels = state.scaledBuffer.data();
+	return surface;
+}
+
+// Where drawing goes: the active layer or the draw buffer
+static Surface getSurface(WindowState &state)
+{
+	Layer *layer = state.activeLayer ? findLayer(state, state.activeLayer) : nullptr;
+	if (!layer)
+		return getDrawBufferSurface(state);
+
+	Surface surface;
+	surface.w = state.drawW;
+	surface.h = state.drawH;
+	surface.stride = state.drawW;
+	surface.pixels = layer->pixels.data();
+	return surface;
+}
+
+// The lowest address of a surface whose rows are contiguous
+static uint32_t *getFirstPixel(const Surface &surface)
+{
+	return surface.stride > 0 ? surface.pixels : surface.row(surface.h - 1);
+}
+
+static Surface subSurface(const Surface &surface, const IntRect &r)
+{
+	Surface sub = surface;
+	sub.pixels = surface.row(r.y) + r.x;
+	sub.w = r.w;
+	sub.h = r.h;
+	return sub;
+}
+
+static uint32_t premultiply(uint32_t color)
+{
+	uint32_t a = color >> 24;
+	return div255((color & 0xff) * a)
+		| div255((color >> 8 & 0xff) * a) << 8
+		| div255((color >> 16 & 0xff) * a) << 16
+		| a << 24;
+}
+
+// Gradients replace pixels with their LUT entries, which must be
+// premultiplied like the rest of a layer's pixels
+static void buildGradientLut(const WindowState &state, GradientLut &lut, const GradientStop *stops, int stopCount)
+{
+	lut.build(stops, stopCount);
+	if (state.activeLayer)
+	{
+		for (uint32_t &color : lut.colors)
+			color = premultiply(color);
+	}
+}
+
+static IntRect intersect(const IntRect &a, const IntRect &b)
+{
+	int x0 = a.x > b.x ? a.x : b.x;
+	int y0 = a.y > b.y ? a.y : b.y;
+	int x1 = a.x + a.w < b.x + b.w ? a.x + a.w : b.x + b.w;
+	int y1 = a.y + a.h < b.y + b.h ? a.y + a.h : b.y + b.h;
+
+	IntRect result;
+	result.x = x0;
+	result.y = y0;
+	result.w = x1 > x0 ? x1 - x0 : 0;
+	result.h = y1 > y0 ? y1 - y0 : 0;
+	return result;
+}
+
+static const Transform &currentTransform(WindowState &state)
+{
+	assert(!state.transformStack.empty());
+	return state.transformStack.back();
+}
+
+// The clip is also bounded by the buffer in case it was resized mid-session
+static IntRect currentClip(WindowState &state)
+{
+	assert(!state.clipStack.empty());
+	IntRect bounds;
+	bounds.w = state.drawW;
+	bounds.h = state.drawH;
+	return intersect(state.clipStack.back(), bounds);
+}
+
+// Transforms rect and rounds it to whole pixels
+static IntRect toPixelRect(const Transform &transform, const Rect &rect)
+{
+	int x0 = int(floorf(transform.x(rect.pos.x) + 0.5f));
+	int y0 = int(floorf(transform.y(rect.pos.y) + 0.5f));
+	int x1 = int(floorf(transform.x(rect.pos.x + rect.size.x) + 0.5f));
+	int y1 = int(floorf(transform.y(rect.pos.y + rect.size.y) + 0.5f));
+
+	IntRect result;
+	result.x = x0;
+	result.y = y0;
+	result.w = x1 > x0 ? x1 - x0 : 0;
+	result.h = y1 > y0 ? y1 - y0 : 0;
+	return result;
+}
+
+// Where a layer's top left lands in the draw buffer
+static int placeLayer(const Transform &transform, float offset)
+{
+	return int(floorf(transform.length(offset) + 0.5f));
+}
+
+// Blends the visible layers over black, lowest zOrder first
+static void composeLayers(WindowState &state)
+{
+	TRACE_ZONE("composeLayers");
+	Surface target = getDrawBufferSurface(state);
+	const KernelTable &kernels = GdiKernels::get();
+	kernels.clear(getFirstPixel(target), size_t(target.w) * size_t(target.h), 0xff000000);
+
+	IntRect bounds;
+	bounds.w = target.w;
+	bounds.h = target.h;
+
+	// Offsets are in window pixels, placed by the base transform whatever the
+	// caller left pushed
+	const Transform &transform = state.transformStack[0];
+
+	for (const Layer &layer : state.layers)
+	{
+		if (!layer.visible || layer.opacity == 0)
+			continue;
+
+		IntRect placed;
+		placed.x = placeLayer(transform, layer.offset.x);
+		placed.y = placeLayer(transform, layer.offset.y);
+		placed.w = target.w;
+		placed.h = target.h;
+		IntRect r = intersect(placed, bounds);
+
+		SpanSource source;
+		source.opacity = layer.opacity;
+		SpanFunction span = PixelPipeline::get(PixelFormat::Bgra, BlendMode::Over, layer.opacity == 255 ? ColorSource::Texture : ColorSource::ScaledTexture);
+		for (int y = r.y; y < r.y + r.h; ++y)
+		{
+			source.pixels = layer.pixels.data() + size_t(y - placed.y) * target.w + (r.x - placed.x);
+			span(target.row(y) + r.x, r.w, source);
+		}
+	}
+
+	state.dirty.add(0, 0, target.w, target.h);
+	state.composeNeeded = false;
+}
+
+static const float MinRenderScale = 0.25f;
+
+static void reserveScaledBuffer(WindowState &state)
+{
+	if (state.buffer && (state.renderScale < 1 || state.targetFrameMs > 0))
+		state.scaledBuffer.resize(size_t(state.w) * size_t(state.h));
+}
+
+// Picks the draw buffer size for the current render scale. Layers have to be
+// redrawn when it changes.
+static void applyRenderScale(WindowState &state)
+{
+	int drawW = state.w;
+	int drawH = state.h;
+	if (state.renderScale < 1)
+	{
+		drawW = int(ceilf(float(state.w) * state.renderScale));
+		drawH = int(ceilf(float(state.h) * state.renderScale));
+		drawW = drawW < 1 ? 1 : drawW;
+		drawH = drawH < 1 ? 1 : drawH;
+
+		if (state.scaledBuffer.size() < size_t(drawW) * size_t(drawH))
+		{
+			drawW = state.w;
+			drawH = state.h;
+		}
+	}
+
+	if (drawW == state.drawW && drawH == state.drawH)
+		return;
+
+	state.drawW = drawW;
+	state.drawH = drawH;
+	for (Layer &layer : state.layers)
+		layer.changed = true;
+	state.composeNeeded = !state.layers.empty();
+}
+
+// Resamples the draw buffer over the whole window buffer
+static void upscale(WindowState &state)
+{
+	TRACE_ZONE("upscale");
+	Surface src = getDrawBufferSurface(state);
+	Surface dst = getBufferSurface(state);
+	const KernelTable &kernels = GdiKernels::get();
+
+	// 16.16 source step per window pixel, sampling at pixel centers
+	int dx = int((int64_t(src.w) << 16) / dst.w);
+	int dy = int((int64_t(src.h) << 16) / dst.h);
+
+	if (state.scaleFilter == ScaleFilter::Nearest)
+	{
+		for (int y = 0; y < dst.h; ++y)
+		{
+			int sy = clampScalePosition(y * dy + dy / 2, src.h) >> 16;
+			kernels.scaleNearest(dst.row(y), dst.w, src.row(sy), src.w, dx / 2, dx);
+		}
+	}
+	else
+	{
+		for (int y = 0; y < dst.h; ++y)
+		{
+			int sy = clampScalePosition(y * dy + dy / 2 - 0x8000, src.h);
+			int row = sy >> 16;
+			int nextRow = row + 1 < src.h ? row + 1 : row;
+			kernels.scaleBilinear(dst.row(y), dst.w, src.row(row), src.row(nextRow), src.w, dx / 2 - 0x8000, dx, uint32_t(sy >> 8) & 0xff);
+		}
+	}
+
+	state.dirty = DirtyRect();
+	state.dirty.add(0, 0, dst.w, dst.h);
+}
+
+// Lowers the render scale when frames take longer than the target and
+// raises it again when there is headroom. Waits a few frames after every
+// change so the average reflects the new scale.
+static void updateRenderScale(WindowState &state)
+{
+	const int SettleFrames = 15;
+
+	float frameMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - state.frameStart).count();
+	state.averageFrameMs = state.averageFrameMs > 0 ? state.averageFrameMs * 0.9f + frameMs * 0.1f : frameMs;
+
+	if (state.targetFrameMs <= 0 || ++state.framesSinceScaleChange < SettleFrames)
+		return;
+
+	float scale = state.renderScale;
+	if (state.averageFrameMs > state.targetFrameMs * 1.1f)
+		scale = scale * 0.9f < MinRenderScale ? MinRenderScale : scale * 0.9f;
+	else if (state.averageFrameMs < state.targetFrameMs * 0.8f)
+		scale = scale * 1.1f > 1 ? 1 : scale * 1.1f;
+
+	if (scale != state.renderScale)
+	{
+		state.renderScale = scale;
+		state.framesSinceScaleChange = 0;
+	}
+}
+
+enum class ClipResult
+{
+	Rejected,
+	Contained,
+	Trimmed
+};
+
+// Classifies a primitive's pixel bounds against the current clip once, so
+// span loops never need to clip. Trimmed bounds are written back.
+static ClipResult clipPrimitive(WindowState &state, IntRect &bounds)
+{
+	if (!state.buffer || bounds.w <= 0 || bounds.h <= 0)
+		return ClipResult::Rejected;
+
+	IntRect clip = currentClip(state);
+	if (bounds.x >= clip.x + clip.w || bounds.y >= clip.y + clip.h || bounds.x + bounds.w <= clip.x || bounds.y + bounds.h <= clip.y)
+		return ClipResult::Rejected;
+
+	if (bounds.x >= clip.x && bounds.y >= clip.y && bounds.x + bounds.w <= clip.x + clip.w && bounds.y + bounds.h <= clip.y + clip.h)
+		return ClipResult::Contained;
+
+	bounds = intersect(bounds, clip);
+	return ClipResult::Trimmed;
+}
+
+// Hit shapes go to the layer being drawn, or to the frame
+static std::vector<HitShape> &getHitShapes(WindowState &state)
+{
+	Layer *layer = state.activeLayer ? findLayer(state, state.activeLayer) : nullptr;
+	return layer ? layer->hitShapes : state.frameHitShapes;
+}
+
+// Records the drawn pixels r of a primitive under the current hit id
+static void recordHit(WindowState &state, const IntRect &r)
+{
+	if (!state.hitId || r.w <= 0 || r.h <= 0)
+		return;
+
+	HitShape shape;
+	shape.bounds = r;
+	shape.id = state.hitId;
+	getHitShapes(state).push_back(shape);
+}
+
+static void recordHitTriangle(WindowState &state, const IntRect &r, const RasterVertex corners[3])
+{
+	if (!state.hitId || r.w <= 0 || r.h <= 0)
+		return;
+
+	HitShape shape;
+	shape.bounds = r;
+	shape.id = state.hitId;
+	shape.triangle = true;
+	for (int i = 0; i < 3; ++i)
+		shape.corners[i] = Vec2{ corners[i].x, corners[i].y };
+	getHitShapes(state).push_back(shape);
+}
+
+// Indexes what the frame shows. Once a window has layers that is their
+// shapes, moved by their offsets, lowest zOrder first.
+static void publishHitIndex(WindowState &state)
+{
+	const Transform &base = state.transformStack[0];
+	state.hitScale = float(base.scale) * (1.0f / ScaleOne);
+
+	if (!state.layers.empty())
+	{
+		IntRect bounds;
+		bounds.w = state.drawW;
+		bounds.h = state.drawH;
+
+		state.frameHitShapes.clear();
+		for (const Layer &layer : state.layers)
+		{
+			if (!layer.visible || layer.opacity == 0)
+				continue;
+
+			int dx = placeLayer(base, layer.offset.x);
+			int dy = placeLayer(base, layer.offset.y);
+			for (HitShape shape : layer.hitShapes)
+			{
+				shape.bounds.x += dx;
+				shape.bounds.y += dy;
+				shape.bounds = intersect(shape.bounds, bounds);
+				for (Vec2 &corner : shape.corners)
+					corner = Vec2{ corner.x + float(dx), corner.y + float(dy) };
+
+				if (shape.bounds.w > 0 && shape.bounds.h > 0)
+					state.frameHitShapes.push_back(shape);
+			}
+		}
+	}
+
+	state.hitIndex.build(state.frameHitShapes, state.drawW, state.drawH);
+}
+
+struct WindowStateMap
+{
+	std::map<HWND, WindowState> map;
+
+	std::vector<PooledDib> pool;
+	uint64_t budgetBytes = 0;
+};
+
+Ref<WindowStateMap> getWindowStateMap()
+{
+	static Guard<WindowStateMap> map;
+	return map;
+}
+
+struct InProgressState
+{
+	bool blitting = false;
+	bool wantsToBlit = false;
+	bool drawing = false;
+	bool wantsToDraw = false;
+
+	// Signalled whenever drawing or blitting ends
+	std::condition_variable changed;
+
+	// Set by tryBeginDrawing while paint has the buffer. paint starts the
+	// drawing session for it and then calls it.
+	DrawingReadyCallback onDrawingReady = nullptr;
+	void *drawingReadyContext = nullptr;
+};
+
+static void waitForChange(Ref<InProgressState> &inProgressState)
+{
+	std::unique_lock<std::mutex> lock(*inProgressState.m, std::adopt_lock);
+	inProgressState->changed.wait(lock);
+	lock.release();
+}
+
+Ref<InProgressState> getInProgressState(HWND hwnd)
+{
+	static Guard<std::map<HWND, InProgressState>> mapState;
+	Ref<std::map<HWND, InProgressState>> map = mapState;
+	InProgressState &state = map->operator[](hwnd);
+	return stealMutex(map, state);
+}
+
+// Backs the DIB with a named mapping so other processes can read it in place.
+// The mapping is sized for the whole virtual screen so it survives resizes
+// while a consumer keeps it open.
+static HBITMAP createSharedDib(WindowState &state, HDC hdc, const BITMAPINFO &bmi)
+{
+	uint64_t pixelBytes = uint64_t(state.w) * uint64_t(state.h) * 4;
+	uint64_t screenBytes = uint64_t(GetSystemMetrics(SM_CXVIRTUALSCREEN)) * uint64_t(GetSystemMetrics(SM_CYVIRTUALSCREEN)) * 4;
+	uint64_t mappingSize = SharedPixelOffset + (pixelBytes > screenBytes ? pixelBytes : screenBytes);
+
+	HANDLE hMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+		DWORD(mappingSize >> 32), DWORD(mappingSize & 0xffffffff), state.sharedName.c_str());
+	if (!hMapping)
+		return nullptr;
+
+	bool existed = GetLastError() == ERROR_ALREADY_EXISTS;
+
+	SharedFrameHeader *header = (SharedFrameHeader *)MapViewOfFile(hMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	if (!header)
+	{
+		CloseHandle(hMapping);
+		return nullptr;
+	}
+
+	if (existed && (header->magic != SharedFrameHeader::Magic || header->mappingSize < SharedPixelOffset + pixelBytes))
+	{
+		UnmapViewOfFile(header);
+		CloseHandle(hMapping);
+		return nullptr;
+	}
+
+	if (!existed)
+	{
+		header->magic = SharedFrameHeader::Magic;
+		header->pixelOffset = SharedPixelOffset;
+		header->mappingSize = mappingSize;
+		header->sequence.store(0, std::memory_order_relaxed);
+		header->frameNumber = 0;
+	}
+
+	HBITMAP hDib = CreateDIBSection(hdc, &bmi, DIB_RGB_COLORS, (void **)&state.buffer, hMapping, SharedPixelOffset);
+	if (!hDib)
+	{
+		UnmapViewOfFile(header);
+		CloseHandle(hMapping);
+		return nullptr;
+	}
+
+	// Resizing swaps the pixels underneath readers, so it counts as a write
+	uint32_t sequence = header->sequence.load(std::memory_order_relaxed);
+	header->sequence.store(sequence | 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	header->w = state.w;
+	header->h = state.h;
+	header->stride = state.w * 4;
+	header->dirtyX = 0;
+	header->dirtyY = 0;
+	header->dirtyW = state.w;
+	header->dirtyH = state.h;
+
+	header->sequence.store((sequence | 1) + 1, std::memory_order_release);
+
+	state.hMapping = hMapping;
+	state.sharedHeader = header;
+	return hDib;
+}
+
+static const int MaxPooledDibs = 8;
+
+// Windows that have not drawn or painted for this long may lose their
+// buffers to stay within the budget
+static const std::chrono::milliseconds EvictableAfter(1000);
+
+// Pooled DIBs nobody has reused for this long are freed, so the sizes a
+// drag-resize passes through don't stay resident
+static const std::chrono::milliseconds PooledDibLifetime(2000);
+
+static void trimPool(WindowStateMap &map)
+{
+	std::chrono::steady_clock::time_point expired = std::chrono::steady_clock::now() - PooledDibLifetime;
+	for (size_t i = map.pool.size(); i > 0; --i)
+	{
+		if (map.pool[i - 1].released < expired)
+		{
+			DeleteObject(map.pool[i - 1].hDib);
+			map.pool.erase(map.pool.begin() + (i - 1));
+		}
+	}
+}
+
+static uint64_t getBufferBytes(const WindowState &state)
+{
+	if (!state.buffer)
+		return 0;
+
+	uint64_t pixels = uint64_t(state.w) * uint64_t(state.h);
+	return (pixels * (1 + state.layers.size()) + state.scaledBuffer.capacity()) * 4;
+}
+
+static uint64_t getResidentBytes(const WindowStateMap &map)
+{
+	uint64_t bytes = 0;
+	for (const auto &it : map.map)
+		bytes += getBufferBytes(it.second);
+
+	for (const PooledDib &dib : map.pool)
+		bytes += uint64_t(dib.w) * uint64_t(dib.h) * 4;
+
+	return bytes;
+}
+
+static bool isBusy(HWND hwnd)
+{
+	Ref<InProgressState> inProgressState = getInProgressState(hwnd);
+	return inProgressState->drawing || inProgressState->wantsToDraw || inProgressState->blitting || inProgressState->wantsToBlit;
+}
+
+static void measureClient(WindowState &state)
+{
+	WINDOWINFO wi;
+	GetWindowInfo(state.hwnd, &wi);
+
+	int h = wi.rcClient.bottom - wi.rcClient.top;
+	int w = wi.rcClient.right - wi.rcClient.left;
+
+	if (h < 1)
+		h = 1;
+
+	if (w < 1)
+		w = 1;
+
+	state.h = h;
+	state.w = w;
+}
+
+static void releaseBuffer(WindowStateMap &map, WindowState &state, bool pool = true);
+
+// Frees pooled DIBs, oldest first, and then the buffers of windows that have
+// been idle the longest, until incomingBytes more fit in the budget. The
+// budget is soft: if every window is in use it is exceeded.
+static void enforceBudget(WindowStateMap &map, uint64_t incomingBytes, const WindowState *keep)
+{
+	if (map.budgetBytes == 0)
+		return;
+
+	uint64_t resident = getResidentBytes(map);
+	if (resident + incomingBytes <= map.budgetBytes)
+		return;
+
+	std::sort(map.pool.begin(), map.pool.end(), [](const PooledDib &a, const PooledDib &b) { return a.released > b.released; });
+	while (!map.pool.empty() && resident + incomingBytes > map.budgetBytes)
+	{
+		const PooledDib &dib = map.pool.back();
+		resident -= uint64_t(dib.w) * uint64_t(dib.h) * 4;
+		DeleteObject(dib.hDib);
+		map.pool.pop_back();
+	}
+
+	std::chrono::steady_clock::time_point idleBefore = std::chrono::steady_clock::now() - EvictableAfter;
+	while (resident + incomingBytes > map.budgetBytes)
+	{
+		WindowState *oldest = nullptr;
+		for (auto &it : map.map)
+		{
+			WindowState &candidate = it.second;
+			if (&candidate == keep || !candidate.buffer || candidate.hMapping || candidate.lastUsed > idleBefore)
+				continue;
+
+			// Buffers being drawn or presented can't be taken away
+			if ((!oldest || candidate.lastUsed < oldest->lastUsed) && !isBusy(candidate.hwnd))
+				oldest = &candidate;
+		}
+
+		if (!oldest)
+			break;
+
+		resident -= getBufferBytes(*oldest);
+		releaseBuffer(map, *oldest, false);
+		oldest->evicted = true;
+	}
+}
+
+// Sizes the buffers to the client area, reusing a pooled DIB of that size
+static void createBuffer(WindowStateMap &map, WindowState &state)
+{
+	assert(!state.buffer);
+	measureClient(state);
+	trimPool(map);
+
+	BITMAPINFO bmi;
+	memset(&bmi, 0, sizeof(bmi));
+	bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+	bmi.bmiHeader.biWidth = state.w;
+	bmi.bmiHeader.biHeight = state.h;
+	bmi.bmiHeader.biPlanes = 1;
+	bmi.bmiHeader.biBitCount = 32;
+	bmi.bmiHeader.biCompression = BI_RGB;
+
+	HDC hDesktopDC = GetDC(state.hwnd);
+	HBITMAP hDib = nullptr;
+
+	uint64_t pixelBytes = uint64_t(state.w) * uint64_t(state.h) * 4;
+	uint64_t extraBytes = pixelBytes * state.layers.size();
+
+	if (!state.sharedName.empty())
+	{
+		enforceBudget(map, pixelBytes + extraBytes, &state);
+		hDib = createSharedDib(state, hDesktopDC, bmi);
+	}
+
+	for (size_t i = 0; !hDib && i < map.pool.size(); ++i)
+	{
+		if (map.pool[i].w == state.w && map.pool[i].h == state.h)
+		{
+			hDib = map.pool[i].hDib;
+			state.buffer = map.pool[i].buffer;
+			map.pool.erase(map.pool.begin() + i);
+			enforceBudget(map, extraBytes, &state);
+
+			// Still holds the last frame of the window that released it
+			GdiKernels::get().clear((uint32_t *)state.buffer, size_t(state.w) * size_t(state.h), 0);
+		}
+	}
+
+	if (!hDib)
+	{
+		enforceBudget(map, pixelBytes + extraBytes, &state);
+		hDib = CreateDIBSection(hDesktopDC, &bmi, DIB_RGB_COLORS, (void **)&state.buffer, 0, 0);
+	}
+
+	if (hDib == NULL)
+	{
+		assert(!"hDib null");
+	}
+
+	if (state.buffer == NULL)
+	{
+		assert(!"buffer was null");
+	}
+
+	state.hDib = hDib;
+	state.hDibDC = CreateCompatibleDC(hDesktopDC);
+
+	for (Layer &layer : state.layers)
+	{
+		layer.pixels.assign(size_t(state.w) * size_t(state.h), 0);
+		layer.changed = true;
+	}
+	state.composeNeeded = !state.layers.empty();
+
+	state.drawW = state.w;
+	state.drawH = state.h;
+	reserveScaledBuffer(state);
+
+	// Draw buffers are never larger than the window buffer
+	state.hitIndex.reserve(state.w, state.h);
+
+	state.hgdiobj = SelectObject(state.hDibDC, hDib);
+	state.evicted = false;
+	state.lastUsed = std::chrono::steady_clock::now();
+
+	ReleaseDC(state.hwnd, hDesktopDC);
+}
+
+// Frees the window's buffers. The DIB goes to the pool unless it is shared
+// with other processes or pool is false.
+static void releaseBuffer(WindowStateMap &map, WindowState &state, bool pool)
+{
+	if (state.hDibDC)
+	{
+		SelectObject(state.hDibDC, state.hgdiobj);
+		DeleteDC(state.hDibDC);
+	}
+
+	if (state.hDib && pool && !state.hMapping)
+	{
+		PooledDib dib;
+		dib.hDib = state.hDib;
+		dib.buffer = state.buffer;
+		dib.w = state.w;
+		dib.h = state.h;
+		dib.released = std::chrono::steady_clock::now();
+		map.pool.push_back(dib);
+
+		trimPool(map);
+		if (map.pool.size() > MaxPooledDibs)
+		{
+			auto oldest = std::min_element(map.pool.begin(), map.pool.end(), [](const PooledDib &a, const PooledDib &b) { return a.released < b.released; });
+			DeleteObject(oldest->hDib);
+			map.pool.erase(oldest);
+		}
+	}
+	else if (state.hDib)
+	{
+		DeleteObject(state.hDib);
+	}
+
+	state.hDib = nullptr;
+	state.hDibDC = nullptr;
+	state.buffer = nullptr;
+
+	if (state.sharedHeader)
+		UnmapViewOfFile(state.sharedHeader);
+
+	if (state.hMapping)
+		CloseHandle(state.hMapping);
+
+	state.sharedHeader = nullptr;
+	state.hMapping = nullptr;
+
+	for (Layer &layer : state.layers)
+	{
+		std::vector<uint32_t>().swap(layer.pixels);
+		layer.changed = true;
+	}
+	std::vector<uint32_t>().swap(state.scaledBuffer);
+	state.drawW = 0;
+	state.drawH = 0;
+}
+
+void GdiDraw::init(void *hwndParam)
+{
+	HWND hwnd = (HWND)hwndParam;
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	state.hwnd = hwnd;
+	state.evicted = false;
+
+	if (state.visible)
+		createBuffer(*map.t, state);
+	else
+		measureClient(state);
+}
+
+void GdiDraw::setVisible(void *hwndParam, bool visible)
+{
+	HWND hwnd = (HWND)hwndParam;
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	if (state.visible == visible)
+		return;
+
+	state.visible = visible;
+	if (!visible)
+	{
+		if (isBusy(hwnd))
+			state.releasePending = true;
+		else
+			releaseBuffer(*map.t, state);
+	}
+	else
+	{
+		state.releasePending = false;
+		if (!state.buffer && state.hwnd)
+		{
+			createBuffer(*map.t, state);
+			InvalidateRect(hwnd, nullptr, FALSE);
+		}
+	}
+}
+
+void GdiDraw::setFramebufferBudget(uint64_t bytes)
+{
+	Ref<WindowStateMap> map = getWindowStateMap();
+	map->budgetBytes = bytes;
+	enforceBudget(*map.t, 0, nullptr);
+}
+
+uint64_t GdiDraw::getFramebufferBytes()
+{
+	Ref<WindowStateMap> map = getWindowStateMap();
+	return getResidentBytes(*map.t);
+}
+
+void GdiDraw::setSharedMemoryName(void *hwndParam, const char *name)
+{
+	HWND hwnd = (HWND)hwndParam;
+	Ref<WindowStateMap> map = getWindowStateMap();
+	map->map[hwnd].sharedName = name ? name : "";
+}
+
+void GdiDraw::deinit(void *hwndParam)
+{
+	HWND hwnd = (HWND)hwndParam;
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	releaseBuffer(*map.t, state);
+	state.evicted = false;
+	state.releasePending = false;
+	state.hitIndex.clear();
+}
+
+// Resets the per-frame state once the caller owns the buffer
+static void startDrawingSession(HWND hwnd)
+{
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	state.dirty = DirtyRect();
+	state.hitId = 0;
+	trimPool(*map.t);
+	state.frameHitShapes.clear();
+
+	if (state.evicted && state.visible && !state.buffer)
+		createBuffer(*map.t, state);
+
+	state.frameStart = std::chrono::steady_clock::now();
+	state.lastUsed = state.frameStart;
+	applyRenderScale(state);
+
+	IntRect full;
+	full.w = state.drawW;
+	full.h = state.drawH;
+	state.clipStack.reset();
+	state.clipStack.push(state.arena, full);
+
+	// Callers draw in window pixels whatever the render scale
+	Transform base;
+	if (isScaled(state))
+		base.scale = int(int64_t(state.drawW) * ScaleOne / state.w);
+	state.transformStack.reset();
+	state.transformStack.push(state.arena, base);
+
+	if (SharedFrameHeader *header = state.sharedHeader)
+	{
+		header->sequence.store(header->sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+}
+
+// Returns the buffer that was presented, or null. It stays valid while the
+// caller is blitting.
+static const unsigned char *paintImpl(HWND hwnd, int &w, int &h)
+{
+	TRACE_ZONE("paintImpl");
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	if (!state.buffer)
+	{
+		// Validates the window so it does not keep asking
+		PAINTSTRUCT paint;
+		BeginPaint(hwnd, &paint);
+		EndPaint(hwnd, &paint);
+		return nullptr;
+	}
+
+	state.lastUsed = std::chrono::steady_clock::now();
+
+	// GdiFlush();
+
+	PAINTSTRUCT paint;
+	HDC hwndDc = BeginPaint(hwnd, &paint);
+	BitBlt(hwndDc, 0, 0, state.w, state.h, state.hDibDC, 0, 0, SRCCOPY);
+	EndPaint(hwnd, &paint);
+
+	w = state.w;
+	h = state.h;
+	return state.buffer;
+}
+
+void GdiDraw::paint(void *hwndParam)
+{
+	HWND hwnd = (HWND)hwndParam;
+
+	{
+		Ref<InProgressState> inProgressState = getInProgressState(hwnd);
+		if (inProgressState->blitting || inProgressState->wantsToBlit)
+			return;
+
+		inProgressState->wantsToBlit = true;
+
+		TRACE_ZONE("Wait for drawing");
+		while (inProgressState->drawing)
+			waitForChange(inProgressState);
+
+		inProgressState->blitting = true;
+		inProgressState->wantsToBlit = false;
+	}
+
+	int w = 0;
+	int h = 0;
+	const unsigned char *presented = paintImpl(hwnd, w, h);
+
+	// Outside the map lock. Blitting keeps the buffer from being drawn to or
+	// released while the frame is copied.
+	if (presented)
+	{
+		FrameRecorder::submit(hwnd, presented, w, h);
+		FrameCapture::submit(hwnd, presented, w, h);
+	}
+
+	DrawingReadyCallback onDrawingReady = nullptr;
+	void *drawingReadyContext = nullptr;
+	{
+		Ref<InProgressState> inProgressState = getInProgressState(hwnd);
+		inProgressState->blitting = false;
+
+		// Hand the buffer straight to a waiting tryBeginDrawing
+		if (inProgressState->onDrawingReady)
+		{
+			onDrawingReady = inProgressState->onDrawingReady;
+			drawingReadyContext = inProgressState->drawingReadyContext;
+			inProgressState->onDrawingReady = nullptr;
+			inProgressState->drawingReadyContext = nullptr;
+			inProgressState->drawing = true;
+		}
+
+		inProgressState->changed.notify_all();
+	}
+
+	if (onDrawingReady)
+	{
+		startDrawingSession(hwnd);
+		onDrawingReady(drawingReadyContext);
+	}
+}
+
+CaptureHandle GdiDraw::captureAsync(void *hwndParam, CaptureFormat format)
+{
+	HWND hwnd = (HWND)hwndParam;
+	CaptureHandle handle = FrameCapture::request(hwnd, format);
+
+	// Presents a frame soon even if nothing else repaints the window
+	InvalidateRect(hwnd, nullptr, FALSE);
+	return handle;
+}
+
+void GdiDraw::draw(void *hwndParam, const GdiDrawInfo &info)
+{
+	TRACE_ZONE("draw");
+	HWND hwnd = (HWND)hwndParam;
+
+	assert(getInProgressState(hwnd)->drawing);
+
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	IntRect r = toPixelRect(currentTransform(state), info.rect);
+	if (clipPrimitive(state, r) == ClipResult::Rejected)
+		return;
+
+	Surface surface = getSurface(state);
+
+	SpanSource source;
+	source.color = info.col.toBgra();
+	bool opaque = (source.color >> 24) == 255;
+	SpanFunction span = PixelPipeline::get(PixelFormat::Bgra, opaque ? BlendMode::Replace : BlendMode::Over, ColorSource::Solid);
+
+	for (int y = r.y; y < r.y + r.h; ++y)
+		span(surface.row(y) + r.x, r.w, source);
+
+	state.dirty.add(r.x, r.y, r.w, r.h);
+	recordHit(state, r);
+}
+
+void GdiDraw::clear(void *hwndParam, Col col)
+{
+	HWND hwnd = (HWND)hwndParam;
+
+	assert(getInProgressState(hwnd)->drawing);
+
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	if (!state.buffer)
+		return;
+
+	const KernelTable &kernels = GdiKernels::get();
+	uint32_t color = col.toBgra();
+	IntRect r = currentClip(state);
+	Surface surface = getSurface(state);
+
+	// Layers hold premultiplied pixels
+	if (state.activeLayer)
+		color = premultiply(color);
+
+	if (r.x == 0 && r.y == 0 && r.w == surface.w && r.h == surface.h)
+	{
+		kernels.clear(getFirstPixel(surface), size_t(surface.w) * size_t(surface.h), color);
+	}
+	else
+	{
+		for (int y = r.y; y < r.y + r.h; ++y)
+			kernels.fill(surface.row(y) + r.x, r.w, color);
+	}
+
+	state.dirty.add(r.x, r.y, r.w, r.h);
+}
+
+int GdiDraw::createLayer(void *hwndParam, int zOrder)
+{
+	HWND hwnd = (HWND)hwndParam;
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	assert(!state.activeLayer && "layers can't be created while one is begun");
+
+	Layer layer;
+	layer.id = state.nextLayerId++;
+	layer.zOrder = zOrder;
+	if (state.buffer)
+		layer.pixels.assign(size_t(state.w) * size_t(state.h), 0);
+	state.layers.push_back(std::move(layer));
+	sortLayers(state);
+	state.composeNeeded = true;
+	return state.nextLayerId - 1;
+}
+
+void GdiDraw::destroyLayer(void *hwndParam, int id)
+{
+	HWND hwnd = (HWND)hwndParam;
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	assert(state.activeLayer != id);
+
+	for (size_t i = 0; i < state.layers.size(); ++i)
+	{
+		if (state.layers[i].id == id)
+		{
+			state.layers.erase(state.layers.begin() + i);
+			state.composeNeeded = true;
+			return;
+		}
+	}
+}
+
+void GdiDraw::setLayerZOrder(void *hwndParam, int id, int zOrder)
+{
+	HWND hwnd = (HWND)hwndParam;
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	if (Layer *layer = findLayer(state, id))
+	{
+		layer->zOrder = zOrder;
+		sortLayers(state);
+		state.composeNeeded = true;
+	}
+}
+
+void GdiDraw::setLayerOpacity(void *hwndParam, int id, float opacity)
+{
+	HWND hwnd = (HWND)hwndParam;
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	if (Layer *layer = findLayer(state, id))
+	{
+		layer->opacity = Col::toByte(opacity);
+		state.composeNeeded = true;
+	}
+}
+
+void GdiDraw::setLayerOffset(void *hwndParam, int id, Vec2 offset)
+{
+	HWND hwnd = (HWND)hwndParam;
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	if (Layer *layer = findLayer(state, id))
+	{
+		layer->offset = offset;
+		state.composeNeeded = true;
+	}
+}
 
-struct WindowStateMap
+void GdiDraw::setLayerVisible(void *hwndParam, int id, bool visible)
 {
-	std::map<HWND, WindowState> map;
-};
+	HWND hwnd = (HWND)hwndParam;
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	if (Layer *layer = findLayer(state, id))
+	{
+		layer->visible = visible;
+		state.composeNeeded = true;
+	}
+}
 
-Ref<WindowStateMap> getWindowStateMap()
+void GdiDraw::setRenderScale(void *hwndParam, float scale, ScaleFilter filter)
 {
-	static Guard<WindowStateMap> map;
-	return map;
+	HWND hwnd = (HWND)hwndParam;
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	state.renderScale = scale < MinRenderScale ? MinRenderScale : scale > 1 ? 1 : scale;
+	state.scaleFilter = filter;
+	state.framesSinceScaleChange = 0;
+	reserveScaledBuffer(state);
 }
 
-struct InProgressState
+float GdiDraw::getRenderScale(void *hwndParam)
 {
-	bool blitting = false;
-	bool wantsToBlit = false;
-	bool drawing = false;
-	bool wantsToDraw = false;
-};
+	HWND hwnd = (HWND)hwndParam;
+	Ref<WindowStateMap> map = getWindowStateMap();
+	return map->map[hwnd].renderScale;
+}
 
-Ref<InProgressState> getInProgressState(HWND hwnd)
+void GdiDraw::setTargetFrameTime(void *hwndParam, float milliseconds)
 {
-	static Guard<std::map<HWND, InProgressState>> mapState;
-	Ref<std::map<HWND, InProgressState>> map = mapState;
-	InProgressState &state = map->operator[](hwnd);
-	return stealMutex(map, state);
+	HWND hwnd = (HWND)hwndParam;
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	state.targetFrameMs = milliseconds > 0 ? milliseconds : 0;
+	state.framesSinceScaleChange = 0;
+	reserveScaledBuffer(state);
 }
 
-void GdiDraw::init(void *hwndParam)
+void GdiDraw::invalidateLayer(void *hwndParam, int id)
 {
 	HWND hwnd = (HWND)hwndParam;
+	Ref<WindowStateMap> map = getWindowStateMap();
+	if (Layer *layer = findLayer(map->map[hwnd], id))
+		layer->changed = true;
+}
+
+bool GdiDraw::beginLayer(void *hwndParam, int id)
+{
+	HWND hwnd = (HWND)hwndParam;
+
+	assert(getInProgressState(hwnd)->drawing);
+
 	Ref<WindowStateMap> map = getWindowStateMap();
 	WindowState &state = map->map[hwnd];
-	state.hwnd = hwnd;
+	assert(!state.activeLayer && "layers don't nest");
 
-	WINDOWINFO wi;
-	GetWindowInfo(state.hwnd, &wi);
+	Layer *layer = findLayer(state, id);
+	if (!layer || !layer->changed || layer->pixels.empty())
+		return false;
 
-	int h = wi.rcClient.bottom - wi.rcClient.top;
-	int w = wi.rcClient.right - wi.rcClient.left;
+	GdiKernels::get().clear(layer->pixels.data(), size_t(state.drawW) * size_t(state.drawH), 0);
+	layer->hitShapes.clear();
+	state.activeLayer = id;
+	return true;
+}
 
-	if (h < 1)
-		h = 1;
+void GdiDraw::endLayer(void *hwndParam)
+{
+	HWND hwnd = (HWND)hwndParam;
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	assert(state.activeLayer);
 
-	if (w < 1)
-		w = 1;
+	if (Layer *layer = findLayer(state, state.activeLayer))
+		layer->changed = false;
 
-	state.h = h;
-	state.w = w;
+	state.activeLayer = 0;
+	state.composeNeeded = true;
+}
 
-	BITMAPINFO bmi;
-	memset(&bmi, 0, sizeof(bmi));
-	bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-	bmi.bmiHeader.biWidth = state.w;
-	bmi.bmiHeader.biHeight = state.h;
-	bmi.bmiHeader.biPlanes = 1;
-	bmi.bmiHeader.biBitCount = 32;
-	bmi.bmiHeader.biCompression = BI_RGB;
+FrameArena &GdiDraw::getFrameArena(void *hwndParam)
+{
+	HWND hwnd = (HWND)hwndParam;
 
-	HDC hDesktopDC = GetDC(hwnd);
-	HBITMAP hDib = CreateDIBSection(hDesktopDC, &bmi, DIB_RGB_COLORS, (void **)&state.buffer, 0, 0);
+	assert(getInProgressState(hwnd)->drawing);
 
-	if (hDib == NULL)
-	{
-		assert(!"hDib null");
-	}
+	// Map nodes never move, so the arena outlives the lock
+	Ref<WindowStateMap> map = getWindowStateMap();
+	return map->map[hwnd].arena;
+}
 
-	if (state.buffer == NULL)
-	{
-		assert(!"buffer was null");
-	}
+void GdiDraw::pushClip(void *hwndParam, const Rect &rect)
+{
+	HWND hwnd = (HWND)hwndParam;
 
-	state.hDibDC = CreateCompatibleDC(hDesktopDC);
-	state.hgdiobj = SelectObject(state.hDibDC, hDib);
+	assert(getInProgressState(hwnd)->drawing);
 
-	ReleaseDC(hwnd, hDesktopDC);
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	IntRect clip = intersect(toPixelRect(currentTransform(state), rect), state.clipStack.back());
+	state.clipStack.push(state.arena, clip);
 }
 
-void GdiDraw::deinit(void *hwndParam)
+void GdiDraw::popClip(void *hwndParam)
+{
+	HWND hwnd = (HWND)hwndParam;
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	assert(state.clipStack.size > 1);
+	if (state.clipStack.size > 1)
+		state.clipStack.pop();
+}
+
+void GdiDraw::pushTranslate(void *hwndParam, Vec2 offset)
 {
 	HWND hwnd = (HWND)hwndParam;
+
+	assert(getInProgressState(hwnd)->drawing);
+
 	Ref<WindowStateMap> map = getWindowStateMap();
 	WindowState &state = map->map[hwnd];
+	Transform transform = currentTransform(state);
+	transform.tx = int(floorf(transform.x(offset.x) + 0.5f));
+	transform.ty = int(floorf(transform.y(offset.y) + 0.5f));
+	state.transformStack.push(state.arena, transform);
+}
 
-	DeleteObject(state.hgdiobj);
+void GdiDraw::pushScale(void *hwndParam, float scale)
+{
+	HWND hwnd = (HWND)hwndParam;
+
+	assert(getInProgressState(hwnd)->drawing);
 
-	ReleaseDC(hwnd, state.hDibDC);
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	Transform transform = currentTransform(state);
+	transform.scale = int(float(transform.scale) * scale + 0.5f);
+	state.transformStack.push(state.arena, transform);
 }
 
-static void paintImpl(HWND hwnd)
+void GdiDraw::popTransform(void *hwndParam)
 {
+	HWND hwnd = (HWND)hwndParam;
 	Ref<WindowStateMap> map = getWindowStateMap();
 	WindowState &state = map->map[hwnd];
+	assert(state.transformStack.size > 1);
+	if (state.transformStack.size > 1)
+		state.transformStack.pop();
+}
 
-	// GdiFlush();
+void GdiDraw::fillLinearGradient(void *hwndParam, const Rect &rect, const LinearGradient &gradient)
+{
+	HWND hwnd = (HWND)hwndParam;
 
-	PAINTSTRUCT paint;
-	HDC hwndDc = BeginPaint(hwnd, &paint);
-	BitBlt(hwndDc, 0, 0, state.w, state.h, state.hDibDC, 0, 0, SRCCOPY);
-	EndPaint(hwnd, &paint);
+	assert(getInProgressState(hwnd)->drawing);
+
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	const Transform &transform = currentTransform(state);
+	IntRect r = toPixelRect(transform, rect);
+	if (clipPrimitive(state, r) == ClipResult::Rejected)
+		return;
+
+	Surface surface = getSurface(state);
+
+	GradientLut lut;
+	buildGradientLut(state, lut, gradient.stops, gradient.stopCount);
+	SpanFunction span = PixelPipeline::get(PixelFormat::Bgra, BlendMode::Replace, ColorSource::LinearGradient);
+
+	// LUT position changes linearly along both axes, so each row only needs
+	// its start position and every pixel adds a constant step.
+	float startX = transform.x(gradient.start.x);
+	float startY = transform.y(gradient.start.y);
+	float dx = transform.x(gradient.end.x) - startX;
+	float dy = transform.y(gradient.end.y) - startY;
+	float length2 = dx * dx + dy * dy;
+	float stepX = length2 > 0 ? dx / length2 * float(GradientLut::Size - 1) : 0;
+	float stepY = length2 > 0 ? dy / length2 * float(GradientLut::Size - 1) : 0;
+
+	SpanSource source;
+	source.lut = lut.colors;
+	source.t0 = (float(r.x) + 0.5f - startX) * stepX + (float(r.y) + 0.5f - startY) * stepY;
+	source.dt = stepX;
+	for (int y = r.y; y < r.y + r.h; ++y, source.t0 += stepY)
+		span(surface.row(y) + r.x, r.w, source);
+
+	state.dirty.add(r.x, r.y, r.w, r.h);
+	recordHit(state, r);
 }
 
-void GdiDraw::paint(void *hwndParam)
+void GdiDraw::fillRadialGradient(void *hwndParam, const Rect &rect, const RadialGradient &gradient)
 {
 	HWND hwnd = (HWND)hwndParam;
 
-	{
-		Ref<InProgressState> inProgressState = getInProgressState(hwnd);
-		if (inProgressState->blitting || inProgressState->wantsToBlit)
-			return;
+	assert(getInProgressState(hwnd)->drawing);
 
-		inProgressState->wantsToBlit = true;
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	const Transform &transform = currentTransform(state);
+	IntRect r = toPixelRect(transform, rect);
+	if (clipPrimitive(state, r) == ClipResult::Rejected)
+		return;
 
-		while (inProgressState->drawing)
-		{
-			InverseMutexGuard ig(*inProgressState.m);
-			sleep(1);
-		}
+	Surface surface = getSurface(state);
 
-		inProgressState->blitting = true;
-		inProgressState->wantsToBlit = false;
+	GradientLut lut;
+	buildGradientLut(state, lut, gradient.stops, gradient.stopCount);
+	SpanFunction span = PixelPipeline::get(PixelFormat::Bgra, BlendMode::Replace, ColorSource::RadialGradient);
+
+	float radius = transform.length(gradient.radius);
+	float centerX = transform.x(gradient.center.x);
+	float centerY = transform.y(gradient.center.y);
+	SpanSource source;
+	source.lut = lut.colors;
+	source.scale = radius > 0 ? float(GradientLut::Size - 1) / radius : 0;
+	source.dx0 = float(r.x) + 0.5f - centerX;
+	for (int y = r.y; y < r.y + r.h; ++y)
+	{
+		float dy = float(y) + 0.5f - centerY;
+		source.dy2 = dy * dy;
+		span(surface.row(y) + r.x, r.w, source);
 	}
 
-	paintImpl(hwnd);
+	state.dirty.add(r.x, r.y, r.w, r.h);
+	recordHit(state, r);
+}
+
+void GdiDraw::boxBlur(void *hwndParam, const Rect &rect, float radius)
+{
+	HWND hwnd = (HWND)hwndParam;
+
+	assert(getInProgressState(hwnd)->drawing);
+
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	IntRect r = toPixelRect(currentTransform(state), rect);
+	if (clipPrimitive(state, r) == ClipResult::Rejected)
+		return;
+
+	int pixelRadius = int(floorf(currentTransform(state).length(radius) + 0.5f));
+	ImageFilters::boxBlur(subSurface(getSurface(state), r), pixelRadius, state.arena);
+	state.dirty.add(r.x, r.y, r.w, r.h);
+}
+
+void GdiDraw::gaussianBlur(void *hwndParam, const Rect &rect, float sigma)
+{
+	HWND hwnd = (HWND)hwndParam;
+
+	assert(getInProgressState(hwnd)->drawing);
+
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	IntRect r = toPixelRect(currentTransform(state), rect);
+	if (clipPrimitive(state, r) == ClipResult::Rejected)
+		return;
+
+	ImageFilters::gaussianBlur(subSurface(getSurface(state), r), currentTransform(state).length(sigma), state.arena);
+	state.dirty.add(r.x, r.y, r.w, r.h);
+}
+
+void GdiDraw::drawShadow(void *hwndParam, const Rect &rect, Vec2 offset, float sigma, Col col)
+{
+	HWND hwnd = (HWND)hwndParam;
+
+	assert(getInProgressState(hwnd)->drawing);
+
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	const Transform &transform = currentTransform(state);
+
+	Rect shadowRect = rect;
+	shadowRect.pos.x += offset.x;
+	shadowRect.pos.y += offset.y;
+	IntRect shape = toPixelRect(transform, shadowRect);
+
+	// The blur spreads the shape by the sum of its box radii
+	int radii[3];
+	ImageFilters::getGaussianBoxRadii(transform.length(sigma), radii);
+	int spread = radii[0] + radii[1] + radii[2];
+
+	IntRect full;
+	full.x = shape.x - spread;
+	full.y = shape.y - spread;
+	full.w = shape.w + 2 * spread;
+	full.h = shape.h + 2 * spread;
+
+	IntRect r = full;
+	if (shape.w <= 0 || shape.h <= 0 || clipPrimitive(state, r) == ClipResult::Rejected)
+		return;
+
+	// The mask covers the whole shadow so clipping does not change the blur
+	const KernelTable &kernels = GdiKernels::get();
+	Surface mask;
+	mask.w = full.w;
+	mask.h = full.h;
+	mask.stride = full.w;
+	mask.pixels = state.arena.allocateArray<uint32_t>(size_t(full.w) * size_t(full.h));
+	kernels.clear(mask.pixels, size_t(full.w) * size_t(full.h), 0);
+
+	uint32_t color = premultiply(col.toBgra());
+	for (int y = spread; y < spread + shape.h; ++y)
+		kernels.fill(mask.row(y) + spread, shape.w, color);
 
+	for (int radius : radii)
+		ImageFilters::boxBlur(mask, radius, state.arena);
+
+	Surface surface = getSurface(state);
+	SpanSource source;
+	SpanFunction span = PixelPipeline::get(PixelFormat::Bgra, BlendMode::Over, ColorSource::Texture);
+	for (int y = r.y; y < r.y + r.h; ++y)
 	{
-		Ref<InProgressState> inProgressState = getInProgressState(hwnd);
-		inProgressState->blitting = false;
+		source.pixels = mask.row(y - full.y) + (r.x - full.x);
+		span(surface.row(y) + r.x, r.w, source);
 	}
+
+	state.dirty.add(r.x, r.y, r.w, r.h);
 }
 
-static void drawImpl(unsigned char *buffer, int w, int h)
+void GdiDraw::drawTriangles(void *hwndParam, const TriangleMesh *meshes, int meshCount)
 {
-	static int v = 0;
-	if (v++ % 50)
-	{
+	TRACE_ZONE("drawTriangles");
+	HWND hwnd = (HWND)hwndParam;
+
+	assert(getInProgressState(hwnd)->drawing);
+
+	Ref<WindowStateMap> map = getWindowStateMap();
+	WindowState &state = map->map[hwnd];
+	if (!state.buffer)
 		return;
-	}
 
-	static int c = 0;
+	const Transform &transform = currentTransform(state);
+	IntRect clip = currentClip(state);
+	Surface surface = getSurface(state);
+	const KernelTable &kernels = GdiKernels::get();
 
-	for (int i = 0, end = w * h * 4; i < end; i += 4)
+	for (int m = 0; m < meshCount; ++m)
 	{
-		++c;
-		buffer[i + 0] = (c / 16) % 255;
-		buffer[i + 1] = (c / 4) % 125;
-		buffer[i + 2] = (c / 4) % 30;
-		buffer[i + 3] = 255;
+		const TriangleMesh &mesh = meshes[m];
+		if (mesh.vertexCount <= 0)
+			continue;
+
+		RasterVertex *transformed = state.arena.allocateArray<RasterVertex>(size_t(mesh.vertexCount));
+		for (int i = 0; i < mesh.vertexCount; ++i)
+		{
+			const ColorVertex &vertex = mesh.vertices[i];
+			uint32_t color = premultiply(vertex.col.toBgra());
+
+			RasterVertex &raster = transformed[i];
+			raster.x = transform.x(vertex.pos.x);
+			raster.y = transform.y(vertex.pos.y);
+			raster.b = float(color & 0xff);
+			raster.g = float(color >> 8 & 0xff);
+			raster.r = float(color >> 16 & 0xff);
+			raster.a = float(color >> 24);
+		}
+
+		int triangleCount = (mesh.indices ? mesh.indexCount : mesh.vertexCount) / 3;
+		for (int t = 0; t < triangleCount; ++t)
+		{
+			RasterVertex corners[3];
+			bool valid = true;
+			for (int i = 0; i < 3; ++i)
+			{
+				uint32_t index = mesh.indices ? mesh.indices[t * 3 + i] : uint32_t(t * 3 + i);
+				assert(index < uint32_t(mesh.vertexCount));
+				valid = valid && index < uint32_t(mesh.vertexCount);
+				corners[i] = valid ? transformed[index] : RasterVertex();
+			}
+
+			if (!valid)
+				continue;
+
+			IntRect r = TriangleRasterizer::drawTriangle(surface, clip, corners, kernels);
+			state.dirty.add(r.x, r.y, r.w, r.h);
+			recordHitTriangle(state, r, corners);
+		}
 	}
 }
 
-void GdiDraw::draw(void *hwndParam, const GdiDrawInfo &info)
+void GdiDraw::setHitId(void *hwndParam, uint32_t id)
 {
 	HWND hwnd = (HWND)hwndParam;
 
 	assert(getInProgressState(hwnd)->drawing);
 
 	Ref<WindowStateMap> map = getWindowStateMap();
-	WindowState &state = map->map[hwnd];
-	drawImpl(state.buffer, state.w, state.h);
+	map->map[hwnd].hitId = id;
+}
+
+uint32_t GdiDraw::hitTest(void *hwndParam, Vec2 pos)
+{
+	HWND hwnd = (HWND)hwndParam;
+
+	Ref<WindowStateMap> map = getWindowStateMap();
+	auto it = map->map.find(hwnd);
+	if (it == map->map.end())
+		return 0;
+
+	const WindowState &state = it->second;
+	return state.hitIndex.query(pos.x * state.hitScale, pos.y * state.hitScale);
 }
 
 void GdiDraw::beginDrawing(void *hwndParam)
 {
 	HWND hwnd = (HWND)hwndParam;
-	Ref<InProgressState> inProgressState = getInProgressState(hwnd);
-	assert(!inProgressState->drawing);
-	assert(!inProgressState->wantsToDraw);
 
-	inProgressState->wantsToDraw = true;
+	{
+		Ref<InProgressState> inProgressState = getInProgressState(hwnd);
+		assert(!inProgressState->drawing);
+		assert(!inProgressState->wantsToDraw);
+
+		inProgressState->wantsToDraw = true;
+
+		TRACE_ZONE("Wait for paint");
+		while (inProgressState->blitting || inProgressState->wantsToBlit)
+			waitForChange(inProgressState);
+
+		inProgressState->drawing = true;
+		inProgressState->wantsToDraw = false;
+	}
+
+	startDrawingSession(hwnd);
+}
+
+bool GdiDraw::tryBeginDrawing(void *hwndParam, DrawingReadyCallback onReady, void *context)
+{
+	HWND hwnd = (HWND)hwndParam;
 
-	while (inProgressState->blitting || inProgressState->wantsToBlit)
 	{
-		InverseMutexGuard ig(*inProgressState.m);
-		sleep(10);
+		Ref<InProgressState> inProgressState = getInProgressState(hwnd);
+		assert(!inProgressState->drawing);
+		assert(!inProgressState->wantsToDraw);
+		assert(!inProgressState->onDrawingReady);
+
+		if (inProgressState->blitting || inProgressState->wantsToBlit)
+		{
+			inProgressState->onDrawingReady = onReady;
+			inProgressState->drawingReadyContext = context;
+			return false;
+		}
+
+		inProgressState->drawing = true;
 	}
 
-	inProgressState->drawing = true;
-	inProgressState->wantsToDraw = false;
+	startDrawingSession(hwnd);
+	return true;
 }
 
 void GdiDraw::endDrawing(void *hwndParam)
 {
 	HWND hwnd = (HWND)hwndParam;
-	getInProgressState(hwnd)->drawing = false;
+
+	{
+		Ref<WindowStateMap> map = getWindowStateMap();
+		WindowState &state = map->map[hwnd];
+
+		assert(!state.activeLayer && "endLayer missing");
+		assert(state.transformStack.size == 1 && state.clipStack.size == 1 && "push without a matching pop");
+		state.activeLayer = 0;
+
+		if (state.composeNeeded && state.buffer)
+			composeLayers(state);
+
+		if (isScaled(state) && state.buffer && state.dirty.x1 > state.dirty.x0)
+			upscale(state);
+
+		updateRenderScale(state);
+		publishHitIndex(state);
+
+		state.clipStack.reset();
+		state.transformStack.reset();
+		state.arena.reset();
+
+		if (SharedFrameHeader *header = state.sharedHeader)
+		{
+			header->frameNumber += 1;
+			header->dirtyX = state.dirty.x0;
+			header->dirtyY = state.dirty.y0;
+			header->dirtyW = state.dirty.x1 - state.dirty.x0;
+			header->dirtyH = state.dirty.y1 - state.dirty.y0;
+			header->sequence.store(header->sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+
+		// After the publish, so a shared header is not unmapped mid-write
+		if (state.releasePending)
+		{
+			releaseBuffer(*map.t, state);
+			state.releasePending = false;
+		}
+	}
+
+	Ref<InProgressState> inProgressState = getInProgressState(hwnd);
+	inProgressState->drawing = false;
+	inProgressState->changed.notify_all();
 }
 
 
@@ -1,10 +1,13 @@
 #pragma once
 
 #include "GdiTypes.h"
+#include "FrameCapture.h"
 
 namespace GdiWindow
 {
 
+struct FrameArena;
+
 struct GdiDrawInfo
 {
 	Rect rect;
@@ -12,14 +15,174 @@ struct GdiDrawInfo
 
 };
 
+struct GradientStop
+{
+	float pos = 0;
+	Col col;
+};
+
+// Stops must be sorted by pos. Colors are clamped before the first stop and
+// after the last one.
+struct LinearGradient
+{
+	Vec2 start, end;
+	const GradientStop *stops = nullptr;
+	int stopCount = 0;
+};
+
+struct RadialGradient
+{
+	Vec2 center;
+	float radius = 0;
+	const GradientStop *stops = nullptr;
+	int stopCount = 0;
+};
+
+struct ColorVertex
+{
+	Vec2 pos;
+	Col col;
+};
+
+// Triangles sharing vertices, three indices each. Without indices every
+// three consecutive vertices are a triangle.
+struct TriangleMesh
+{
+	const ColorVertex *vertices = nullptr;
+	int vertexCount = 0;
+	const uint32_t *indices = nullptr;
+	int indexCount = 0;
+};
+
+typedef void(*DrawingReadyCallback)(void *context);
+
+enum class ScaleFilter
+{
+	Nearest,
+	Bilinear,
+};
+
 struct GdiDraw
 {
 	static void init(void *hwnd);
 	static void deinit(void *hwnd);
+
+	// Hidden windows give their buffers back, keeping the DIB in a small
+	// pool for a couple of seconds for reuse, and get new, cleared ones when
+	// shown. Layers are redrawn after. Shared-memory buffers are never pooled:
+	// hiding unmaps them and showing creates a new mapping under the same name.
+	static void setVisible(void *hwnd, bool visible);
+
+	// Caps the bytes of all window buffers and pooled DIBs. When a new buffer
+	// would exceed it, pooled DIBs are freed first and then the buffers of
+	// windows that have gone longest without drawing or painting; those get
+	// new buffers at their next beginDrawing. Zero, the default, means no
+	// limit.
+	static void setFramebufferBudget(uint64_t bytes);
+	static uint64_t getFramebufferBytes();
 	static void paint(void *hwnd);
 	static void draw(void* hwnd, const GdiDrawInfo& info);
+	static void clear(void *hwnd, Col col);
 	static void beginDrawing(void* hwnd);
 	static void endDrawing(void* hwnd);
+
+	// beginDrawing that does not block. If paint is presenting the buffer,
+	// returns false and paint starts the session when it is done and then
+	// calls onReady from the window's thread. Otherwise starts the session
+	// and returns true without calling onReady.
+	static bool tryBeginDrawing(void *hwnd, DrawingReadyCallback onReady, void *context);
+
+	// Replace the pixels of rect with the gradient. Positions are in the
+	// coordinates of the current transform.
+	static void fillLinearGradient(void *hwnd, const Rect &rect, const LinearGradient &gradient);
+	static void fillRadialGradient(void *hwnd, const Rect &rect, const RadialGradient &gradient);
+
+	// Blur the pixels under rect in place, e.g. the backdrop behind a popup.
+	// Pixels outside rect are not sampled. Radius and sigma are in the
+	// units of the current transform.
+	static void boxBlur(void *hwnd, const Rect &rect, float radius);
+	static void gaussianBlur(void *hwnd, const Rect &rect, float sigma);
+
+	// Blends a Gaussian blurred copy of rect in col, moved by offset, over
+	// what is drawn. Draw it before the shape that casts it.
+	static void drawShadow(void *hwnd, const Rect &rect, Vec2 offset, float sigma, Col col);
+
+	// Blends the triangles of the meshes over what is drawn, with the vertex
+	// colors interpolated across each one. Each vertex is transformed once
+	// per call however many triangles use it. Triangles sharing an edge
+	// neither overlap nor leave gaps along it, so a mesh with translucent
+	// colors blends every pixel once.
+	static void drawTriangles(void *hwnd, const TriangleMesh *meshes, int meshCount = 1);
+
+	// Hit testing. While a hit id other than zero is set, rects, gradients
+	// and mesh triangles record the pixels they draw under it; shadows and
+	// blurs are not recorded. endDrawing builds a grid over the frame's
+	// shapes, which hitTest queries until the next endDrawing. Layers keep
+	// the shapes from when they were last drawn. The id is reset to zero by
+	// beginDrawing, and nothing is recorded or indexed while it stays zero.
+	static void setHitId(void *hwnd, uint32_t id);
+
+	// The id of the topmost recorded shape under pos, in client pixels, or
+	// zero. Callable from any thread, e.g. the window's on mouse moves.
+	static uint32_t hitTest(void *hwnd, Vec2 pos);
+
+	// Clip and transform stacks of the current drawing session. Both start
+	// at beginDrawing with the whole window and the base transform, which
+	// maps window pixels to the draw buffer, and that entry can't be popped.
+	// Every push must be popped again before endDrawing. Clip rects are given
+	// in the current transform and intersect with the enclosing clip.
+	// Translations are rounded to whole pixels.
+	static void pushClip(void *hwnd, const Rect &rect);
+	static void popClip(void *hwnd);
+	static void pushTranslate(void *hwnd, Vec2 offset);
+	static void pushScale(void *hwnd, float scale);
+	static void popTransform(void *hwnd);
+
+	// Offscreen layers, composited over black into the window buffer by
+	// endDrawing in zOrder, lowest first. Once a window has layers the
+	// composite replaces the buffer, so everything should be drawn in one.
+	// Layers keep their pixels between frames and are only composited again
+	// when one was redrawn or its properties changed.
+	static int createLayer(void *hwnd, int zOrder);
+	static void destroyLayer(void *hwnd, int layer);
+	static void setLayerZOrder(void *hwnd, int layer, int zOrder);
+	static void setLayerOpacity(void *hwnd, int layer, float opacity);
+	static void setLayerOffset(void *hwnd, int layer, Vec2 offset);
+	static void setLayerVisible(void *hwnd, int layer, bool visible);
+
+	// Marks a layer for redrawing. New and resized layers start marked.
+	static void invalidateLayer(void *hwnd, int layer);
+
+	// During a drawing session, returns true if the layer is marked and then
+	// clears it and sends drawing to it until endLayer. Returns false, and
+	// keeps the last contents, if it does not need redrawing.
+	static bool beginLayer(void *hwnd, int layer);
+	static void endLayer(void *hwnd);
+
+	// Dynamic resolution. Below 1, drawing sessions render to a smaller
+	// buffer that endDrawing upscales to the window with the filter.
+	// Coordinates stay in window pixels. The scale is clamped to [0.25, 1]
+	// and takes effect at the next beginDrawing.
+	static void setRenderScale(void *hwnd, float scale, ScaleFilter filter = ScaleFilter::Bilinear);
+	static float getRenderScale(void *hwnd);
+
+	// Adjusts the render scale to keep the time between beginDrawing and
+	// endDrawing near the target. Zero turns it off and keeps the current
+	// scale.
+	static void setTargetFrameTime(void *hwnd, float milliseconds);
+
+	// Scratch memory for the current drawing session, for the drawing thread
+	// only. Everything in it is released by endDrawing.
+	static FrameArena &getFrameArena(void *hwnd);
+
+	// Returns a handle that completes with a copy of the next frame paint
+	// presents. paint only copies the buffer; format conversion happens on a
+	// worker thread.
+	static CaptureHandle captureAsync(void *hwnd, CaptureFormat format = CaptureFormat::BottomUpBgra);
+
+	// Places the window's buffer in a named shared-memory mapping on the next
+	// init so other processes can read frames in place. See SharedFrame.h.
+	static void setSharedMemoryName(void *hwnd, const char *name);
 };
 
 }
@@ -0,0 +1,520 @@
+#include "GdiKernels.h"
+
+#include "GdiDrawing.h"
+#include "PixelPipeline.h"
+
+#include <intrin.h>
+#include <math.h>
+#include <random>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+namespace GdiWindow
+{
+
+static const float MaxLutPosition = float(GradientLut::Size - 1);
+
+void GradientLut::build(const GradientStop *stops, int stopCount)
+{
+	if (stopCount <= 0)
+	{
+		for (int i = 0; i < Size; ++i)
+			colors[i] = 0;
+		return;
+	}
+
+	int segment = 0;
+	for (int i = 0; i < Size; ++i)
+	{
+		float t = float(i) / MaxLutPosition;
+
+		while (segment + 1 < stopCount && stops[segment + 1].pos <= t)
+			++segment;
+
+		const GradientStop &a = stops[segment];
+		if (t <= a.pos || segment + 1 == stopCount)
+		{
+			colors[i] = a.col.toBgra();
+			continue;
+		}
+
+		const GradientStop &b = stops[segment + 1];
+		float f = (t - a.pos) / (b.pos - a.pos);
+		Col col(
+			a.col.r + (b.col.r - a.col.r) * f,
+			a.col.g + (b.col.g - a.col.g) * f,
+			a.col.b + (b.col.b - a.col.b) * f,
+			a.col.a + (b.col.a - a.col.a) * f);
+		colors[i] = col.toBgra();
+	}
+}
+
+// The scalar spans are instantiations of the pixel pipeline
+
+static void fillScalar(uint32_t *dst, int count, uint32_t color)
+{
+	SpanSource source;
+	source.color = color;
+	runSpan<BgraFormat, ReplaceBlend, SolidSource>(dst, count, source);
+}
+
+static void blendColorScalar(uint32_t *dst, int count, uint32_t color)
+{
+	SpanSource source;
+	source.color = color;
+	runSpan<BgraFormat, OverBlend, SolidSource>(dst, count, source);
+}
+
+static void blendScalar(uint32_t *dst, const uint32_t *src, int count)
+{
+	SpanSource source;
+	source.pixels = src;
+	runSpan<BgraFormat, OverBlend, TextureSource>(dst, count, source);
+}
+
+static void blendOpacityScalar(uint32_t *dst, const uint32_t *src, int count, uint32_t opacity)
+{
+	SpanSource source;
+	source.pixels = src;
+	source.opacity = opacity;
+	runSpan<BgraFormat, OverBlend, ScaledTextureSource>(dst, count, source);
+}
+
+static void blitScalar(uint32_t *dst, const uint32_t *src, int count)
+{
+	SpanSource source;
+	source.pixels = src;
+	runSpan<BgraFormat, ReplaceBlend, TextureSource>(dst, count, source);
+}
+
+static void clearScalar(uint32_t *dst, size_t count, uint32_t color)
+{
+	for (size_t i = 0; i < count; ++i)
+		dst[i] = color;
+}
+
+static void swapRedBlueScalar(uint32_t *dst, const uint32_t *src, int count)
+{
+	SpanSource source;
+	source.pixels = src;
+	runSpan<RgbaFormat, ReplaceBlend, TextureSource>(dst, count, source);
+}
+
+static void linearGradientScalar(uint32_t *dst, int count, float t0, float dt, const uint32_t *lut)
+{
+	SpanSource source;
+	source.lut = lut;
+	source.t0 = t0;
+	source.dt = dt;
+	runSpan<BgraFormat, ReplaceBlend, LinearGradientSource>(dst, count, source);
+}
+
+static void radialGradientScalar(uint32_t *dst, int count, float dx0, float dy2, float scale, const uint32_t *lut)
+{
+	SpanSource source;
+	source.lut = lut;
+	source.dx0 = dx0;
+	source.dy2 = dy2;
+	source.scale = scale;
+	runSpan<BgraFormat, ReplaceBlend, RadialGradientSource>(dst, count, source);
+}
+
+static void scaleNearestScalar(uint32_t *dst, int count, const uint32_t *src, int srcCount, int x0, int dx)
+{
+	for (int i = 0; i < count; ++i)
+		dst[i] = src[clampScalePosition(x0 + dx * i, srcCount) >> 16];
+}
+
+static inline uint32_t lerpChannels(uint32_t a, uint32_t b, uint32_t t)
+{
+	uint32_t result = 0;
+	for (int shift = 0; shift < 32; shift += 8)
+		result |= ((a >> shift & 0xff) * (256 - t) + (b >> shift & 0xff) * t) >> 8 << shift;
+	return result;
+}
+
+static void scaleBilinearScalar(uint32_t *dst, int count, const uint32_t *row0, const uint32_t *row1, int srcCount, int x0, int dx, uint32_t fy)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		int x = clampScalePosition(x0 + dx * i, srcCount);
+		int ix = x >> 16;
+		int ix1 = ix + 1 < srcCount ? ix + 1 : ix;
+		uint32_t fx = uint32_t(x >> 8) & 0xff;
+
+		uint32_t top = lerpChannels(row0[ix], row0[ix1], fx);
+		uint32_t bottom = lerpChannels(row1[ix], row1[ix1], fx);
+		dst[i] = lerpChannels(top, bottom, fy);
+	}
+}
+
+// One channel of a box blur along count pixels step apart
+static void boxBlurLineScalar(uint32_t *dst, ptrdiff_t dstStep, const uint32_t *src, ptrdiff_t srcStep, int count, int radius)
+{
+	uint32_t scale = boxBlurScale(radius);
+	int last = count - 1;
+
+	for (int shift = 0; shift < 32; shift += 8)
+	{
+		uint32_t sum = (src[0] >> shift & 0xff) * uint32_t(radius + 1);
+		for (int i = 1; i <= radius; ++i)
+			sum += src[(i < last ? i : last) * srcStep] >> shift & 0xff;
+
+		for (int i = 0; i < count; ++i)
+		{
+			uint32_t &pixel = dst[i * dstStep];
+			pixel = (shift ? pixel : 0) | boxBlurDivide(sum, scale) << shift;
+
+			int add = i + radius + 1;
+			int remove = i - radius;
+			sum += src[(add < last ? add : last) * srcStep] >> shift & 0xff;
+			sum -= src[(remove > 0 ? remove : 0) * srcStep] >> shift & 0xff;
+		}
+	}
+}
+
+static void boxBlurRowScalar(uint32_t *dst, const uint32_t *src, int count, int radius)
+{
+	if (count > 0)
+		boxBlurLineScalar(dst, 1, src, 1, count, radius);
+}
+
+static void boxBlurColumnsScalar(uint32_t *dst, ptrdiff_t dstStride, const uint32_t *src, ptrdiff_t srcStride, int columns, int rows, int radius)
+{
+	for (int x = 0; rows > 0 && x < columns; ++x)
+		boxBlurLineScalar(dst + x, dstStride, src + x, srcStride, rows, radius);
+}
+
+static void triangleSpanScalar(uint32_t *dst, int count, const TriangleSpan &span)
+{
+	TriangleSpan s = span;
+	for (int i = 0; i < count; ++i)
+	{
+		if ((s.edges[0] | s.edges[1] | s.edges[2]) >= 0)
+		{
+			uint32_t src = 0;
+			for (int c = 0; c < 4; ++c)
+			{
+				int32_t v = s.colors[c] >> 16;
+				src |= uint32_t(v < 0 ? 0 : v > 255 ? 255 : v) << (c * 8);
+			}
+			blendScalar(dst + i, &src, 1);
+		}
+
+		s = advanceTriangleSpan(s, 1);
+	}
+}
+
+const KernelTable &GdiKernels::scalar()
+{
+	static const KernelTable table = {
+		fillScalar,
+		blendColorScalar,
+		blendScalar,
+		blendOpacityScalar,
+		blitScalar,
+		clearScalar,
+		swapRedBlueScalar,
+		linearGradientScalar,
+		radialGradientScalar,
+		scaleNearestScalar,
+		scaleBilinearScalar,
+		boxBlurRowScalar,
+		boxBlurColumnsScalar,
+		triangleSpanScalar,
+	};
+	return table;
+}
+
+struct CpuFeatures
+{
+	bool sse2 = false;
+	bool avx2 = false;
+	bool avx512 = false;
+
+	CpuFeatures()
+	{
+		int info[4];
+		__cpuid(info, 0);
+		int maxLeaf = info[0];
+
+		__cpuid(info, 1);
+		sse2 = (info[3] & (1 << 26)) != 0;
+		bool osxsave = (info[2] & (1 << 27)) != 0;
+		bool avx = (info[2] & (1 << 28)) != 0;
+
+		if (maxLeaf < 7 || !osxsave || !avx)
+			return;
+
+		// The OS has to save the wider registers on context switches too
+		unsigned long long xcr0 = _xgetbv(0);
+		bool ymmState = (xcr0 & 0x6) == 0x6;
+		bool zmmState = (xcr0 & 0xe6) == 0xe6;
+
+		__cpuidex(info, 7, 0);
+		avx2 = ymmState && (info[1] & (1 << 5)) != 0;
+		avx512 = zmmState && (info[1] & (1 << 16)) != 0 && (info[1] & (1 << 30)) != 0;
+	}
+};
+
+static const CpuFeatures &getCpuFeatures()
+{
+	static CpuFeatures features;
+	return features;
+}
+
+bool GdiKernels::isSupported(KernelIsa isa)
+{
+	const CpuFeatures &features = getCpuFeatures();
+	switch (isa)
+	{
+	case KernelIsa::Scalar: return true;
+	case KernelIsa::Sse2: return features.sse2;
+	case KernelIsa::Avx2: return features.avx2;
+	case KernelIsa::Avx512: return features.avx512;
+	default: return false;
+	}
+}
+
+const char *GdiKernels::getName(KernelIsa isa)
+{
+	switch (isa)
+	{
+	case KernelIsa::Scalar: return "scalar";
+	case KernelIsa::Sse2: return "sse2";
+	case KernelIsa::Avx2: return "avx2";
+	case KernelIsa::Avx512: return "avx512";
+	default: return "unknown";
+	}
+}
+
+const KernelTable &GdiKernels::get(KernelIsa isa)
+{
+	switch (isa)
+	{
+	case KernelIsa::Sse2: return sse2();
+	case KernelIsa::Avx2: return avx2();
+	case KernelIsa::Avx512: return avx512();
+	default: return scalar();
+	}
+}
+
+static KernelIsa pickIsa()
+{
+	KernelIsa best = KernelIsa::Scalar;
+	for (int i = 0; i < int(KernelIsa::Count); ++i)
+	{
+		if (GdiKernels::isSupported(KernelIsa(i)))
+			best = KernelIsa(i);
+	}
+
+	char *forced = nullptr;
+	size_t length = 0;
+	if (_dupenv_s(&forced, &length, "GDIWINDOW_KERNELS") == 0 && forced)
+	{
+		for (int i = 0; i < int(KernelIsa::Count); ++i)
+		{
+			if (_stricmp(forced, GdiKernels::getName(KernelIsa(i))) == 0 && GdiKernels::isSupported(KernelIsa(i)))
+				best = KernelIsa(i);
+		}
+		free(forced);
+	}
+
+	return best;
+}
+
+KernelIsa GdiKernels::selectedIsa()
+{
+	static KernelIsa isa = pickIsa();
+	return isa;
+}
+
+const KernelTable &GdiKernels::get()
+{
+	static const KernelTable &table = get(selectedIsa());
+	return table;
+}
+
+static bool gradientPixelMatches(uint32_t value, uint32_t expected, const uint32_t *lut)
+{
+	if (value == expected)
+		return true;
+
+	for (int i = 0; i < GradientLut::Size; ++i)
+	{
+		if (lut[i] != expected)
+			continue;
+
+		if (i > 0 && lut[i - 1] == value)
+			return true;
+		if (i + 1 < GradientLut::Size && lut[i + 1] == value)
+			return true;
+	}
+
+	return false;
+}
+
+KernelVerifyResult GdiKernels::verify(KernelIsa isa)
+{
+	KernelVerifyResult result;
+	if (!isSupported(isa))
+		return result;
+
+	const KernelTable &reference = scalar();
+	const KernelTable &tested = get(isa);
+
+	std::mt19937 random(1234);
+	auto randomPixel = [&random]() { return uint32_t(random()); };
+
+	auto fail = [&result](const char *name) {
+		if (!result.firstFailure)
+			result.firstFailure = name;
+		result.failures += 1;
+	};
+
+	GradientLut lut;
+	for (int i = 0; i < GradientLut::Size; ++i)
+		lut.colors[i] = randomPixel();
+
+	// Spans start at every offset within a cache line and cover widths around
+	// all the vector sizes.
+	const int MaxWidth = 131;
+	const int MaxOffset = 16;
+	std::vector<uint32_t> src(MaxWidth + MaxOffset);
+	std::vector<uint32_t> expected(MaxWidth + MaxOffset);
+	std::vector<uint32_t> actual(MaxWidth + MaxOffset);
+
+	for (int round = 0; round < 4; ++round)
+	{
+		for (int offset = 0; offset < MaxOffset; ++offset)
+		{
+			for (int width = 0; width <= MaxWidth; ++width)
+			{
+				for (size_t i = 0; i < src.size(); ++i)
+				{
+					src[i] = randomPixel();
+					expected[i] = actual[i] = randomPixel();
+				}
+
+				uint32_t color = randomPixel();
+				if (round == 1)
+					color |= 0xff000000;
+				else if (round == 2)
+					color &= 0x00ffffff;
+
+				auto compare = [&](const char *name) {
+					result.checks += 1;
+					if (memcmp(expected.data(), actual.data(), expected.size() * sizeof(uint32_t)) != 0)
+						fail(name);
+					memcpy(actual.data(), expected.data(), expected.size() * sizeof(uint32_t));
+				};
+
+				reference.fill(&expected[offset], width, color);
+				tested.fill(&actual[offset], width, color);
+				compare("fill");
+
+				reference.blendColor(&expected[offset], width, color);
+				tested.blendColor(&actual[offset], width, color);
+				compare("blendColor");
+
+				reference.blend(&expected[offset], &src[offset], width);
+				tested.blend(&actual[offset], &src[offset], width);
+				compare("blend");
+
+				reference.blendOpacity(&expected[offset], &src[offset], width, color >> 24);
+				tested.blendOpacity(&actual[offset], &src[offset], width, color >> 24);
+				compare("blendOpacity");
+
+				reference.blit(&expected[offset], &src[MaxOffset - 1 - offset], width);
+				tested.blit(&actual[offset], &src[MaxOffset - 1 - offset], width);
+				compare("blit");
+
+				reference.clear(&expected[offset], size_t(width), color);
+				tested.clear(&actual[offset], size_t(width), color);
+				compare("clear");
+
+				reference.swapRedBlue(&expected[offset], &src[offset], width);
+				tested.swapRedBlue(&actual[offset], &src[offset], width);
+				compare("swapRedBlue");
+
+				auto compareGradient = [&](const char *name) {
+					result.checks += 1;
+					for (size_t i = 0; i < expected.size(); ++i)
+					{
+						if (!gradientPixelMatches(actual[i], expected[i], lut.colors))
+						{
+							fail(name);
+							break;
+						}
+					}
+					memcpy(actual.data(), expected.data(), expected.size() * sizeof(uint32_t));
+				};
+
+				float t0 = float(int(random() % 1024) - 512) * 0.37f;
+				float dt = float(int(random() % 2048) - 1024) * 0.013f;
+				reference.linearGradient(&expected[offset], width, t0, dt, lut.colors);
+				tested.linearGradient(&actual[offset], width, t0, dt, lut.colors);
+				compareGradient("linearGradient");
+
+				float dx0 = float(int(random() % 512) - 256) * 0.5f;
+				float dy2 = float(random() % 4096);
+				float scale = float(random() % 1000) * 0.01f;
+				reference.radialGradient(&expected[offset], width, dx0, dy2, scale, lut.colors);
+				tested.radialGradient(&actual[offset], width, dx0, dy2, scale, lut.colors);
+				compareGradient("radialGradient");
+
+				// Sources narrower and wider than the span, starting before,
+				// inside and past the row
+				int srcCount = 1 + int(random() % MaxWidth);
+				int x0 = int(random() % (srcCount * 3 << 16)) - (srcCount << 16);
+				int scaleDx = int(random() % (1 << 18));
+				uint32_t fy = random() % 256;
+				const uint32_t *row1 = &src[MaxOffset - 1 - offset];
+
+				reference.scaleNearest(&expected[offset], width, &src[0], srcCount, x0, scaleDx);
+				tested.scaleNearest(&actual[offset], width, &src[0], srcCount, x0, scaleDx);
+				compare("scaleNearest");
+
+				reference.scaleBilinear(&expected[offset], width, &src[0], row1, srcCount, x0, scaleDx, fy);
+				tested.scaleBilinear(&actual[offset], width, &src[0], row1, srcCount, x0, scaleDx, fy);
+				compare("scaleBilinear");
+
+				// Radii smaller and larger than the span
+				int radius = int(random() % 40);
+				reference.boxBlurRow(&expected[offset], &src[0], width, radius);
+				tested.boxBlurRow(&actual[offset], &src[0], width, radius);
+				compare("boxBlurRow");
+
+				// src as a block of columns wide rows, blurred into dst with a
+				// wider stride
+				int columns = 1 + int(random() % 9);
+				int rows = width / 16;
+				reference.boxBlurColumns(&expected[offset], 16, &src[0], columns, columns, rows, radius);
+				tested.boxBlurColumns(&actual[offset], 16, &src[0], columns, columns, rows, radius);
+				compare("boxBlurColumns");
+
+				// Edges crossing zero inside the span and colors running past
+				// both ends of the channel range
+				TriangleSpan span;
+				for (int i = 0; i < 3; ++i)
+				{
+					span.edges[i] = int32_t(random() % (1 << 21)) - (1 << 20);
+					span.edgeSteps[i] = int32_t(random() % (1 << 18)) - (1 << 17);
+				}
+				for (int i = 0; i < 4; ++i)
+				{
+					span.colors[i] = int32_t(random() % (384 << 16)) - (64 << 16);
+					span.colorSteps[i] = int32_t(random() % (16 << 16)) - (8 << 16);
+				}
+				reference.triangleSpan(&expected[offset], width, span);
+				tested.triangleSpan(&actual[offset], width, span);
+				compare("triangleSpan");
+			}
+		}
+	}
+
+	return result;
+}
+
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+#include "GdiTypes.h"
+
+namespace GdiWindow
+{
+
+struct GradientStop;
+
+struct IntRect
+{
+	int x = 0, y = 0, w = 0, h = 0;
+};
+
+// Colors of a multi-stop gradient sampled at Size evenly spaced positions so
+// spans only need a clamp and a table lookup per pixel.
+struct GradientLut
+{
+	static const int Size = 256;
+
+	void build(const GradientStop *stops, int stopCount);
+
+	uint32_t colors[Size];
+};
+
+// A span of a triangle: its three edge functions and four premultiplied
+// channels at the first pixel, and how much each changes per pixel to the
+// right. Colors are 16.16 B, G, R and A.
+struct TriangleSpan
+{
+	int32_t edges[3];
+	int32_t edgeSteps[3];
+	int32_t colors[4];
+	int32_t colorSteps[4];
+};
+
+enum class KernelIsa
+{
+	Scalar,
+	Sse2,
+	Avx2,
+	Avx512,
+	Count
+};
+
+// Pixel kernels work on BGRA spans. Every variant produces the same bytes as
+// the scalar one, except the gradients which may pick a neighbouring LUT
+// entry due to float rounding.
+struct KernelTable
+{
+	void (*fill)(uint32_t *dst, int count, uint32_t color);
+
+	// Straight-alpha color over dst
+	void (*blendColor)(uint32_t *dst, int count, uint32_t color);
+
+	// Premultiplied src over dst
+	void (*blend)(uint32_t *dst, const uint32_t *src, int count);
+
+	// Premultiplied src scaled by opacity (0-255) over dst
+	void (*blendOpacity)(uint32_t *dst, const uint32_t *src, int count, uint32_t opacity);
+
+	void (*blit)(uint32_t *dst, const uint32_t *src, int count);
+
+	// Fills a large contiguous block, bypassing the cache where possible
+	void (*clear)(uint32_t *dst, size_t count, uint32_t color);
+
+	// BGRA <-> RGBA
+	void (*swapRedBlue)(uint32_t *dst, const uint32_t *src, int count);
+
+	// t0 is the LUT position of the first pixel and dt the step per pixel.
+	void (*linearGradient)(uint32_t *dst, int count, float t0, float dt, const uint32_t *lut);
+
+	// dx0 is the x distance of the first pixel from the center, dy2 the squared
+	// y distance of the row and scale converts a distance to a LUT position.
+	void (*radialGradient)(uint32_t *dst, int count, float dx0, float dy2, float scale, const uint32_t *lut);
+
+	// Resample one row of srcCount pixels. x0 is the 16.16 source position of
+	// the first pixel and dx the step per pixel; positions outside the row are
+	// clamped to its ends. Nearest takes the pixel the position falls in.
+	void (*scaleNearest)(uint32_t *dst, int count, const uint32_t *src, int srcCount, int x0, int dx);
+
+	// Bilinear between pixel centers at whole positions, and between row0
+	// and row1 by fy (0-255). Weights have 8 bits of precision.
+	void (*scaleBilinear)(uint32_t *dst, int count, const uint32_t *row0, const uint32_t *row1, int srcCount, int x0, int dx, uint32_t fy);
+
+	// Box blur of one row, a running sum over 2 * radius + 1 pixels with the
+	// edge pixels repeated past the ends. radius is below 32768. dst and src
+	// must not overlap.
+	void (*boxBlurRow)(uint32_t *dst, const uint32_t *src, int count, int radius);
+
+	// The same down each of columns adjacent columns. Strides are in pixels.
+	void (*boxBlurColumns)(uint32_t *dst, ptrdiff_t dstStride, const uint32_t *src, ptrdiff_t srcStride, int columns, int rows, int radius);
+
+	// Blends the pixels a triangle covers, those where no edge function is
+	// negative, like blend. Channels are clamped to 0-255. The steps must not
+	// take any value out of 32 bits within the span.
+	void (*triangleSpan)(uint32_t *dst, int count, const TriangleSpan &span);
+};
+
+struct KernelVerifyResult
+{
+	int checks = 0;
+	int failures = 0;
+	const char *firstFailure = nullptr;
+};
+
+struct GdiKernels
+{
+	// The best supported table, picked on first use. Setting the environment
+	// variable GDIWINDOW_KERNELS to scalar, sse2, avx2 or avx512 forces a
+	// variant if the CPU supports it.
+	static const KernelTable &get();
+	static KernelIsa selectedIsa();
+
+	static bool isSupported(KernelIsa isa);
+	static const char *getName(KernelIsa isa);
+	static const KernelTable &get(KernelIsa isa);
+
+	// Runs a variant against the scalar reference on random inputs, widths
+	// and alignments.
+	static KernelVerifyResult verify(KernelIsa isa);
+
+	static const KernelTable &scalar();
+	static const KernelTable &sse2();
+	static const KernelTable &avx2();
+	static const KernelTable &avx512();
+};
+
+static inline uint32_t div255(uint32_t x)
+{
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+static inline int clampScalePosition(int x, int srcCount)
+{
+	int last = (srcCount - 1) << 16;
+	return x < 0 ? 0 : x > last ? last : x;
+}
+
+// Box sums are divided by the window size with a 32-bit reciprocal and a
+// 64-bit product. For windows of up to 65535 pixels the quotient is within
+// 0.002 of exact before rounding, where a 16-bit reciprocal is off by several
+// levels once windows reach a few thousand pixels. A window of one rounds 2^32 down,
+// which still gives the sum back.
+static inline uint32_t boxBlurScale(int radius)
+{
+	uint64_t size = uint64_t(2 * radius + 1);
+	uint64_t scale = ((uint64_t(1) << 32) + size / 2) / size;
+	return scale > 0xffffffff ? 0xffffffff : uint32_t(scale);
+}
+
+static inline uint32_t boxBlurDivide(uint32_t sum, uint32_t scale)
+{
+	uint32_t x = uint32_t((uint64_t(sum) * scale + 0x80000000) >> 32);
+	return x > 255 ? 255 : x;
+}
+
+// The same triangle span count pixels further right
+static inline TriangleSpan advanceTriangleSpan(const TriangleSpan &span, int count)
+{
+	TriangleSpan result = span;
+	for (int i = 0; i < 3; ++i)
+		result.edges[i] = int32_t(uint32_t(span.edges[i]) + uint32_t(span.edgeSteps[i]) * uint32_t(count));
+	for (int i = 0; i < 4; ++i)
+		result.colors[i] = int32_t(uint32_t(span.colors[i]) + uint32_t(span.colorSteps[i]) * uint32_t(count));
+	return result;
+}
+
+static inline float clampLutPosition(float t)
+{
+	return t < 0 ? 0 : t > float(GradientLut::Size - 1) ? float(GradientLut::Size - 1) : t;
+}
+
+}
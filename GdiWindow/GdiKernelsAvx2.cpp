@@ -0,0 +1,375 @@
+#include "GdiKernels.h"
+
+#include <immintrin.h>
+
+// Built with /arch:AVX2 and only called after GdiKernels checked the CPU.
+
+namespace GdiWindow
+{
+
+static inline __m256i div255Avx2(__m256i x)
+{
+	x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+	return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+static void fillAvx2(uint32_t *dst, int count, uint32_t color)
+{
+	__m256i c = _mm256_set1_epi32(int(color));
+	int i = 0;
+	for (; i + 8 <= count; i += 8)
+		_mm256_storeu_si256((__m256i *)(dst + i), c);
+
+	GdiKernels::sse2().fill(dst + i, count - i, color);
+}
+
+static void blendColorAvx2(uint32_t *dst, int count, uint32_t color)
+{
+	uint32_t a = color >> 24;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i inv = _mm256_set1_epi16(short(255 - a));
+	__m256i src = _mm256_unpacklo_epi8(_mm256_set1_epi32(int(color | 0xff000000)), zero);
+	src = _mm256_mullo_epi16(src, _mm256_set1_epi16(short(a)));
+
+	int i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+		__m256i lo = div255Avx2(_mm256_add_epi16(src, _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), inv)));
+		__m256i hi = div255Avx2(_mm256_add_epi16(src, _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), inv)));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(lo, hi));
+	}
+
+	GdiKernels::sse2().blendColor(dst + i, count - i, color);
+}
+
+static void blendAvx2(uint32_t *dst, const uint32_t *src, int count)
+{
+	// Broadcasts each pixel's alpha byte over its four channels
+	__m256i alphaShuffle = _mm256_setr_epi8(
+		3, -1, 3, -1, 3, -1, 3, -1, 7, -1, 7, -1, 7, -1, 7, -1,
+		3, -1, 3, -1, 3, -1, 3, -1, 7, -1, 7, -1, 7, -1, 7, -1);
+	__m256i zero = _mm256_setzero_si256();
+	__m256i full = _mm256_set1_epi16(255);
+
+	int i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+
+		__m256i sHi = _mm256_unpackhi_epi64(s, s);
+		__m256i invLo = _mm256_sub_epi16(full, _mm256_shuffle_epi8(s, alphaShuffle));
+		__m256i invHi = _mm256_sub_epi16(full, _mm256_shuffle_epi8(sHi, alphaShuffle));
+
+		__m256i lo = div255Avx2(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), invLo));
+		__m256i hi = div255Avx2(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), invHi));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_adds_epu8(s, _mm256_packus_epi16(lo, hi)));
+	}
+
+	GdiKernels::sse2().blend(dst + i, src + i, count - i);
+}
+
+static inline __m256i inverseAlphaAvx2(__m256i pixels16)
+{
+	__m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(pixels16, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+	return _mm256_sub_epi16(_mm256_set1_epi16(255), alpha);
+}
+
+static void blendOpacityAvx2(uint32_t *dst, const uint32_t *src, int count, uint32_t opacity)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i scale = _mm256_set1_epi16(short(opacity));
+
+	int i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+
+		__m256i sLo = div255Avx2(_mm256_mullo_epi16(_mm256_unpacklo_epi8(s, zero), scale));
+		__m256i sHi = div255Avx2(_mm256_mullo_epi16(_mm256_unpackhi_epi8(s, zero), scale));
+		__m256i lo = _mm256_add_epi16(sLo, div255Avx2(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), inverseAlphaAvx2(sLo))));
+		__m256i hi = _mm256_add_epi16(sHi, div255Avx2(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), inverseAlphaAvx2(sHi))));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(lo, hi));
+	}
+
+	GdiKernels::sse2().blendOpacity(dst + i, src + i, count - i, opacity);
+}
+
+static void blitAvx2(uint32_t *dst, const uint32_t *src, int count)
+{
+	int i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 8));
+		_mm256_storeu_si256((__m256i *)(dst + i), a);
+		_mm256_storeu_si256((__m256i *)(dst + i + 8), b);
+	}
+
+	GdiKernels::sse2().blit(dst + i, src + i, count - i);
+}
+
+static void clearAvx2(uint32_t *dst, size_t count, uint32_t color)
+{
+	size_t i = 0;
+	while (i < count && (uintptr_t(dst + i) & 31) != 0)
+		dst[i++] = color;
+
+	__m256i c = _mm256_set1_epi32(int(color));
+	for (; i + 8 <= count; i += 8)
+		_mm256_stream_si256((__m256i *)(dst + i), c);
+
+	_mm_sfence();
+
+	GdiKernels::scalar().clear(dst + i, count - i, color);
+}
+
+static void swapRedBlueAvx2(uint32_t *dst, const uint32_t *src, int count)
+{
+	__m256i shuffle = _mm256_setr_epi8(
+		2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+		2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+	int i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i c = _mm256_loadu_si256((const __m256i *)(src + i));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(c, shuffle));
+	}
+
+	GdiKernels::sse2().swapRedBlue(dst + i, src + i, count - i);
+}
+
+static inline __m256i lutLookupAvx2(const uint32_t *lut, __m256 t)
+{
+	t = _mm256_min_ps(_mm256_max_ps(t, _mm256_setzero_ps()), _mm256_set1_ps(float(GradientLut::Size - 1)));
+	__m256i index = _mm256_cvttps_epi32(_mm256_add_ps(t, _mm256_set1_ps(0.5f)));
+	return _mm256_i32gather_epi32((const int *)lut, index, 4);
+}
+
+static void linearGradientAvx2(uint32_t *dst, int count, float t0, float dt, const uint32_t *lut)
+{
+	__m256 t0v = _mm256_set1_ps(t0);
+	__m256 dtv = _mm256_set1_ps(dt);
+	__m256 index = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256 step = _mm256_set1_ps(8);
+
+	int i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		_mm256_storeu_si256((__m256i *)(dst + i), lutLookupAvx2(lut, _mm256_add_ps(t0v, _mm256_mul_ps(dtv, index))));
+		index = _mm256_add_ps(index, step);
+	}
+
+	GdiKernels::scalar().linearGradient(dst + i, count - i, t0 + dt * float(i), dt, lut);
+}
+
+static void radialGradientAvx2(uint32_t *dst, int count, float dx0, float dy2, float scale, const uint32_t *lut)
+{
+	__m256 dx = _mm256_add_ps(_mm256_set1_ps(dx0), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7));
+	__m256 dy2v = _mm256_set1_ps(dy2);
+	__m256 scalev = _mm256_set1_ps(scale);
+	__m256 step = _mm256_set1_ps(8);
+
+	int i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256 dist = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), dy2v));
+		_mm256_storeu_si256((__m256i *)(dst + i), lutLookupAvx2(lut, _mm256_mul_ps(dist, scalev)));
+		dx = _mm256_add_ps(dx, step);
+	}
+
+	GdiKernels::scalar().radialGradient(dst + i, count - i, dx0 + float(i), dy2, scale, lut);
+}
+
+static inline __m256i lerpAvx2(__m256i a, __m256i b, __m256i t)
+{
+	__m256i inv = _mm256_sub_epi16(_mm256_set1_epi16(256), t);
+	return _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(a, inv), _mm256_mullo_epi16(b, t)), 8);
+}
+
+static void scaleNearestAvx2(uint32_t *dst, int count, const uint32_t *src, int srcCount, int x0, int dx)
+{
+	__m256i x = _mm256_add_epi32(_mm256_set1_epi32(x0), _mm256_mullo_epi32(_mm256_set1_epi32(dx), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));
+	__m256i step = _mm256_set1_epi32(dx * 8);
+	__m256i last = _mm256_set1_epi32((srcCount - 1) << 16);
+
+	int i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i clamped = _mm256_min_epi32(_mm256_max_epi32(x, _mm256_setzero_si256()), last);
+		__m256i pixels = _mm256_i32gather_epi32((const int *)src, _mm256_srai_epi32(clamped, 16), 4);
+		_mm256_storeu_si256((__m256i *)(dst + i), pixels);
+		x = _mm256_add_epi32(x, step);
+	}
+
+	GdiKernels::scalar().scaleNearest(dst + i, count - i, src, srcCount, x0 + dx * i, dx);
+}
+
+static void scaleBilinearAvx2(uint32_t *dst, int count, const uint32_t *row0, const uint32_t *row1, int srcCount, int x0, int dx, uint32_t fy)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i fyv = _mm256_set1_epi16(short(fy));
+	__m256i x = _mm256_add_epi32(_mm256_set1_epi32(x0), _mm256_mullo_epi32(_mm256_set1_epi32(dx), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));
+	__m256i step = _mm256_set1_epi32(dx * 8);
+	__m256i last = _mm256_set1_epi32((srcCount - 1) << 16);
+	__m256i lastIndex = _mm256_set1_epi32(srcCount - 1);
+	__m256i one = _mm256_set1_epi32(1);
+
+	int i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i clamped = _mm256_min_epi32(_mm256_max_epi32(x, zero), last);
+		__m256i ix = _mm256_srai_epi32(clamped, 16);
+		__m256i ix1 = _mm256_min_epi32(_mm256_add_epi32(ix, one), lastIndex);
+
+		// Each pixel's weight repeated over its four 16-bit channels, in the
+		// order unpacklo and unpackhi leave the pixels
+		__m256i fx = _mm256_and_si256(_mm256_srli_epi32(clamped, 8), _mm256_set1_epi32(0xff));
+		fx = _mm256_or_si256(fx, _mm256_slli_epi32(fx, 16));
+		__m256i fxLo = _mm256_unpacklo_epi32(fx, fx);
+		__m256i fxHi = _mm256_unpackhi_epi32(fx, fx);
+
+		__m256i a = _mm256_i32gather_epi32((const int *)row0, ix, 4);
+		__m256i b = _mm256_i32gather_epi32((const int *)row0, ix1, 4);
+		__m256i c = _mm256_i32gather_epi32((const int *)row1, ix, 4);
+		__m256i d = _mm256_i32gather_epi32((const int *)row1, ix1, 4);
+
+		__m256i topLo = lerpAvx2(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero), fxLo);
+		__m256i topHi = lerpAvx2(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero), fxHi);
+		__m256i bottomLo = lerpAvx2(_mm256_unpacklo_epi8(c, zero), _mm256_unpacklo_epi8(d, zero), fxLo);
+		__m256i bottomHi = lerpAvx2(_mm256_unpackhi_epi8(c, zero), _mm256_unpackhi_epi8(d, zero), fxHi);
+
+		__m256i lo = lerpAvx2(topLo, bottomLo, fyv);
+		__m256i hi = lerpAvx2(topHi, bottomHi, fyv);
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(lo, hi));
+		x = _mm256_add_epi32(x, step);
+	}
+
+	GdiKernels::sse2().scaleBilinear(dst + i, count - i, row0, row1, srcCount, x0 + dx * i, dx, fy);
+}
+
+// Two adjacent pixels, all channels, as 32-bit lanes
+static inline __m256i unpackPixelPairAvx2(const uint32_t *pixels)
+{
+	return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)pixels));
+}
+
+static inline void boxBlurStorePairAvx2(uint32_t *dst, __m256i sum, __m256i scale)
+{
+	// boxBlurDivide, with the odd lanes multiplied shifted down
+	__m256i half = _mm256_set1_epi64x(0x80000000);
+	__m256i even = _mm256_add_epi64(_mm256_mul_epu32(sum, scale), half);
+	__m256i odd = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(sum, 32), scale), half);
+	__m256i x = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xaa);
+	__m128i packed = _mm_packs_epi32(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+	_mm_storel_epi64((__m128i *)dst, _mm_packus_epi16(packed, packed));
+}
+
+// Two columns side by side per register. The running sum along a row is
+// serial, so rows use the SSE2 kernel.
+static void boxBlurColumnsAvx2(uint32_t *dst, ptrdiff_t dstStride, const uint32_t *src, ptrdiff_t srcStride, int columns, int rows, int radius)
+{
+	__m256i scale = _mm256_set1_epi32(int(boxBlurScale(radius)));
+	int last = rows - 1;
+
+	int x = 0;
+	for (; rows > 0 && x + 2 <= columns; x += 2)
+	{
+		const uint32_t *column = src + x;
+		__m256i sum = _mm256_mullo_epi32(unpackPixelPairAvx2(column), _mm256_set1_epi32(radius + 1));
+		for (int i = 1; i <= radius; ++i)
+			sum = _mm256_add_epi32(sum, unpackPixelPairAvx2(column + (i < last ? i : last) * srcStride));
+
+		for (int i = 0; i < rows; ++i)
+		{
+			boxBlurStorePairAvx2(dst + i * dstStride + x, sum, scale);
+
+			int add = i + radius + 1;
+			int remove = i - radius;
+			sum = _mm256_add_epi32(sum, unpackPixelPairAvx2(column + (add < last ? add : last) * srcStride));
+			sum = _mm256_sub_epi32(sum, unpackPixelPairAvx2(column + (remove > 0 ? remove : 0) * srcStride));
+		}
+	}
+
+	GdiKernels::sse2().boxBlurColumns(dst + x, dstStride, src + x, srcStride, columns - x, rows, radius);
+}
+
+static inline __m256i spanLanesAvx2(int32_t value, int32_t step)
+{
+	uint32_t v = uint32_t(value);
+	uint32_t s = uint32_t(step);
+	return _mm256_setr_epi32(int(v), int(v + s), int(v + 2 * s), int(v + 3 * s), int(v + 4 * s), int(v + 5 * s), int(v + 6 * s), int(v + 7 * s));
+}
+
+// Eight pixels per step, so a whole row of a rasterizer block at once
+static void triangleSpanAvx2(uint32_t *dst, int count, const TriangleSpan &span)
+{
+	__m256i edges[3], edgeSteps[3], colors[4], colorSteps[4];
+	for (int k = 0; k < 3; ++k)
+	{
+		edges[k] = spanLanesAvx2(span.edges[k], span.edgeSteps[k]);
+		edgeSteps[k] = _mm256_set1_epi32(int(uint32_t(span.edgeSteps[k]) * 8));
+	}
+	for (int c = 0; c < 4; ++c)
+	{
+		colors[c] = spanLanesAvx2(span.colors[c], span.colorSteps[c]);
+		colorSteps[c] = _mm256_set1_epi32(int(uint32_t(span.colorSteps[c]) * 8));
+	}
+
+	// Packing leaves B0-3 G0-3 R0-3 A0-3 in each 128-bit lane
+	__m256i toPixels = _mm256_setr_epi8(
+		0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15,
+		0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+	__m256i zero = _mm256_setzero_si256();
+
+	int i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i outside = _mm256_srai_epi32(_mm256_or_si256(_mm256_or_si256(edges[0], edges[1]), edges[2]), 31);
+		if (_mm256_movemask_epi8(outside) != -1)
+		{
+			__m256i bg = _mm256_packs_epi32(_mm256_srai_epi32(colors[0], 16), _mm256_srai_epi32(colors[1], 16));
+			__m256i ra = _mm256_packs_epi32(_mm256_srai_epi32(colors[2], 16), _mm256_srai_epi32(colors[3], 16));
+			__m256i s = _mm256_shuffle_epi8(_mm256_packus_epi16(bg, ra), toPixels);
+
+			__m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+			__m256i lo = div255Avx2(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), inverseAlphaAvx2(_mm256_unpacklo_epi8(s, zero))));
+			__m256i hi = div255Avx2(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), inverseAlphaAvx2(_mm256_unpackhi_epi8(s, zero))));
+			__m256i blended = _mm256_adds_epu8(s, _mm256_packus_epi16(lo, hi));
+			_mm256_storeu_si256((__m256i *)(dst + i), _mm256_blendv_epi8(blended, d, outside));
+		}
+
+		for (int k = 0; k < 3; ++k)
+			edges[k] = _mm256_add_epi32(edges[k], edgeSteps[k]);
+		for (int c = 0; c < 4; ++c)
+			colors[c] = _mm256_add_epi32(colors[c], colorSteps[c]);
+	}
+
+	GdiKernels::sse2().triangleSpan(dst + i, count - i, advanceTriangleSpan(span, i));
+}
+
+const KernelTable &GdiKernels::avx2()
+{
+	static const KernelTable table = {
+		fillAvx2,
+		blendColorAvx2,
+		blendAvx2,
+		blendOpacityAvx2,
+		blitAvx2,
+		clearAvx2,
+		swapRedBlueAvx2,
+		linearGradientAvx2,
+		radialGradientAvx2,
+		scaleNearestAvx2,
+		scaleBilinearAvx2,
+		GdiKernels::sse2().boxBlurRow,
+		boxBlurColumnsAvx2,
+		triangleSpanAvx2,
+	};
+	return table;
+}
+
+}
@@ -0,0 +1,296 @@
+#include "GdiKernels.h"
+
+#include <immintrin.h>
+
+// Built with /arch:AVX512 and only called after GdiKernels checked the CPU
+// for AVX-512F and AVX-512BW. Tails use masked loads and stores instead of
+// falling back to narrower code.
+
+namespace GdiWindow
+{
+
+static inline __mmask16 tailMask(int remaining)
+{
+	return remaining >= 16 ? __mmask16(0xffff) : __mmask16((1u << remaining) - 1);
+}
+
+static inline __m512i div255Avx512(__m512i x)
+{
+	x = _mm512_add_epi16(x, _mm512_set1_epi16(128));
+	return _mm512_srli_epi16(_mm512_add_epi16(x, _mm512_srli_epi16(x, 8)), 8);
+}
+
+static void fillAvx512(uint32_t *dst, int count, uint32_t color)
+{
+	__m512i c = _mm512_set1_epi32(int(color));
+	for (int i = 0; i < count; i += 16)
+		_mm512_mask_storeu_epi32(dst + i, tailMask(count - i), c);
+}
+
+static void blendColorAvx512(uint32_t *dst, int count, uint32_t color)
+{
+	uint32_t a = color >> 24;
+	__m512i zero = _mm512_setzero_si512();
+	__m512i inv = _mm512_set1_epi16(short(255 - a));
+	__m512i src = _mm512_unpacklo_epi8(_mm512_set1_epi32(int(color | 0xff000000)), zero);
+	src = _mm512_mullo_epi16(src, _mm512_set1_epi16(short(a)));
+
+	for (int i = 0; i < count; i += 16)
+	{
+		__mmask16 mask = tailMask(count - i);
+		__m512i d = _mm512_maskz_loadu_epi32(mask, dst + i);
+		__m512i lo = div255Avx512(_mm512_add_epi16(src, _mm512_mullo_epi16(_mm512_unpacklo_epi8(d, zero), inv)));
+		__m512i hi = div255Avx512(_mm512_add_epi16(src, _mm512_mullo_epi16(_mm512_unpackhi_epi8(d, zero), inv)));
+		_mm512_mask_storeu_epi32(dst + i, mask, _mm512_packus_epi16(lo, hi));
+	}
+}
+
+static void blendAvx512(uint32_t *dst, const uint32_t *src, int count)
+{
+	__m512i alphaShuffle = _mm512_set4_epi32(int(0xff07ff07), int(0xff07ff07), int(0xff03ff03), int(0xff03ff03));
+	__m512i zero = _mm512_setzero_si512();
+	__m512i full = _mm512_set1_epi16(255);
+
+	for (int i = 0; i < count; i += 16)
+	{
+		__mmask16 mask = tailMask(count - i);
+		__m512i s = _mm512_maskz_loadu_epi32(mask, src + i);
+		__m512i d = _mm512_maskz_loadu_epi32(mask, dst + i);
+
+		__m512i sHi = _mm512_unpackhi_epi64(s, s);
+		__m512i invLo = _mm512_sub_epi16(full, _mm512_shuffle_epi8(s, alphaShuffle));
+		__m512i invHi = _mm512_sub_epi16(full, _mm512_shuffle_epi8(sHi, alphaShuffle));
+
+		__m512i lo = div255Avx512(_mm512_mullo_epi16(_mm512_unpacklo_epi8(d, zero), invLo));
+		__m512i hi = div255Avx512(_mm512_mullo_epi16(_mm512_unpackhi_epi8(d, zero), invHi));
+		_mm512_mask_storeu_epi32(dst + i, mask, _mm512_adds_epu8(s, _mm512_packus_epi16(lo, hi)));
+	}
+}
+
+static inline __m512i inverseAlphaAvx512(__m512i pixels16)
+{
+	__m512i alpha = _mm512_shufflehi_epi16(_mm512_shufflelo_epi16(pixels16, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+	return _mm512_sub_epi16(_mm512_set1_epi16(255), alpha);
+}
+
+static void blendOpacityAvx512(uint32_t *dst, const uint32_t *src, int count, uint32_t opacity)
+{
+	__m512i zero = _mm512_setzero_si512();
+	__m512i scale = _mm512_set1_epi16(short(opacity));
+
+	for (int i = 0; i < count; i += 16)
+	{
+		__mmask16 mask = tailMask(count - i);
+		__m512i s = _mm512_maskz_loadu_epi32(mask, src + i);
+		__m512i d = _mm512_maskz_loadu_epi32(mask, dst + i);
+
+		__m512i sLo = div255Avx512(_mm512_mullo_epi16(_mm512_unpacklo_epi8(s, zero), scale));
+		__m512i sHi = div255Avx512(_mm512_mullo_epi16(_mm512_unpackhi_epi8(s, zero), scale));
+		__m512i lo = _mm512_add_epi16(sLo, div255Avx512(_mm512_mullo_epi16(_mm512_unpacklo_epi8(d, zero), inverseAlphaAvx512(sLo))));
+		__m512i hi = _mm512_add_epi16(sHi, div255Avx512(_mm512_mullo_epi16(_mm512_unpackhi_epi8(d, zero), inverseAlphaAvx512(sHi))));
+		_mm512_mask_storeu_epi32(dst + i, mask, _mm512_packus_epi16(lo, hi));
+	}
+}
+
+static void blitAvx512(uint32_t *dst, const uint32_t *src, int count)
+{
+	for (int i = 0; i < count; i += 16)
+	{
+		__mmask16 mask = tailMask(count - i);
+		_mm512_mask_storeu_epi32(dst + i, mask, _mm512_maskz_loadu_epi32(mask, src + i));
+	}
+}
+
+static void clearAvx512(uint32_t *dst, size_t count, uint32_t color)
+{
+	size_t i = 0;
+	while (i < count && (uintptr_t(dst + i) & 63) != 0)
+		dst[i++] = color;
+
+	__m512i c = _mm512_set1_epi32(int(color));
+	for (; i + 16 <= count; i += 16)
+		_mm512_stream_si512((__m512i *)(dst + i), c);
+
+	_mm_sfence();
+
+	if (i < count)
+		_mm512_mask_storeu_epi32(dst + i, tailMask(int(count - i)), c);
+}
+
+static void swapRedBlueAvx512(uint32_t *dst, const uint32_t *src, int count)
+{
+	__m512i shuffle = _mm512_set4_epi32(0x0f0c0d0e, 0x0b08090a, 0x07040506, 0x03000102);
+
+	for (int i = 0; i < count; i += 16)
+	{
+		__mmask16 mask = tailMask(count - i);
+		__m512i c = _mm512_maskz_loadu_epi32(mask, src + i);
+		_mm512_mask_storeu_epi32(dst + i, mask, _mm512_shuffle_epi8(c, shuffle));
+	}
+}
+
+static inline void lutStoreAvx512(uint32_t *dst, __mmask16 mask, const uint32_t *lut, __m512 t)
+{
+	t = _mm512_min_ps(_mm512_max_ps(t, _mm512_setzero_ps()), _mm512_set1_ps(float(GradientLut::Size - 1)));
+	__m512i index = _mm512_cvttps_epi32(_mm512_add_ps(t, _mm512_set1_ps(0.5f)));
+	__m512i colors = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), mask, index, (const int *)lut, 4);
+	_mm512_mask_storeu_epi32(dst, mask, colors);
+}
+
+static void linearGradientAvx512(uint32_t *dst, int count, float t0, float dt, const uint32_t *lut)
+{
+	__m512 t0v = _mm512_set1_ps(t0);
+	__m512 dtv = _mm512_set1_ps(dt);
+	__m512 index = _mm512_setr_ps(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	__m512 step = _mm512_set1_ps(16);
+
+	for (int i = 0; i < count; i += 16)
+	{
+		lutStoreAvx512(dst + i, tailMask(count - i), lut, _mm512_add_ps(t0v, _mm512_mul_ps(dtv, index)));
+		index = _mm512_add_ps(index, step);
+	}
+}
+
+static void radialGradientAvx512(uint32_t *dst, int count, float dx0, float dy2, float scale, const uint32_t *lut)
+{
+	__m512 dx = _mm512_add_ps(_mm512_set1_ps(dx0), _mm512_setr_ps(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+	__m512 dy2v = _mm512_set1_ps(dy2);
+	__m512 scalev = _mm512_set1_ps(scale);
+	__m512 step = _mm512_set1_ps(16);
+
+	for (int i = 0; i < count; i += 16)
+	{
+		__m512 dist = _mm512_sqrt_ps(_mm512_add_ps(_mm512_mul_ps(dx, dx), dy2v));
+		lutStoreAvx512(dst + i, tailMask(count - i), lut, _mm512_mul_ps(dist, scalev));
+		dx = _mm512_add_ps(dx, step);
+	}
+}
+
+static inline __m512i lerpAvx512(__m512i a, __m512i b, __m512i t)
+{
+	__m512i inv = _mm512_sub_epi16(_mm512_set1_epi16(256), t);
+	return _mm512_srli_epi16(_mm512_add_epi16(_mm512_mullo_epi16(a, inv), _mm512_mullo_epi16(b, t)), 8);
+}
+
+static void scaleNearestAvx512(uint32_t *dst, int count, const uint32_t *src, int srcCount, int x0, int dx)
+{
+	__m512i x = _mm512_add_epi32(_mm512_set1_epi32(x0), _mm512_mullo_epi32(_mm512_set1_epi32(dx),
+		_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)));
+	__m512i step = _mm512_set1_epi32(dx * 16);
+	__m512i last = _mm512_set1_epi32((srcCount - 1) << 16);
+
+	for (int i = 0; i < count; i += 16)
+	{
+		__mmask16 mask = tailMask(count - i);
+		__m512i clamped = _mm512_min_epi32(_mm512_max_epi32(x, _mm512_setzero_si512()), last);
+		__m512i pixels = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), mask, _mm512_srai_epi32(clamped, 16), (const int *)src, 4);
+		_mm512_mask_storeu_epi32(dst + i, mask, pixels);
+		x = _mm512_add_epi32(x, step);
+	}
+}
+
+static void scaleBilinearAvx512(uint32_t *dst, int count, const uint32_t *row0, const uint32_t *row1, int srcCount, int x0, int dx, uint32_t fy)
+{
+	__m512i zero = _mm512_setzero_si512();
+	__m512i fyv = _mm512_set1_epi16(short(fy));
+	__m512i x = _mm512_add_epi32(_mm512_set1_epi32(x0), _mm512_mullo_epi32(_mm512_set1_epi32(dx),
+		_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)));
+	__m512i step = _mm512_set1_epi32(dx * 16);
+	__m512i last = _mm512_set1_epi32((srcCount - 1) << 16);
+	__m512i lastIndex = _mm512_set1_epi32(srcCount - 1);
+	__m512i one = _mm512_set1_epi32(1);
+
+	for (int i = 0; i < count; i += 16)
+	{
+		__mmask16 mask = tailMask(count - i);
+		__m512i clamped = _mm512_min_epi32(_mm512_max_epi32(x, zero), last);
+		__m512i ix = _mm512_srai_epi32(clamped, 16);
+		__m512i ix1 = _mm512_min_epi32(_mm512_add_epi32(ix, one), lastIndex);
+
+		__m512i fx = _mm512_and_si512(_mm512_srli_epi32(clamped, 8), _mm512_set1_epi32(0xff));
+		fx = _mm512_or_si512(fx, _mm512_slli_epi32(fx, 16));
+		__m512i fxLo = _mm512_unpacklo_epi32(fx, fx);
+		__m512i fxHi = _mm512_unpackhi_epi32(fx, fx);
+
+		__m512i a = _mm512_mask_i32gather_epi32(zero, mask, ix, (const int *)row0, 4);
+		__m512i b = _mm512_mask_i32gather_epi32(zero, mask, ix1, (const int *)row0, 4);
+		__m512i c = _mm512_mask_i32gather_epi32(zero, mask, ix, (const int *)row1, 4);
+		__m512i d = _mm512_mask_i32gather_epi32(zero, mask, ix1, (const int *)row1, 4);
+
+		__m512i topLo = lerpAvx512(_mm512_unpacklo_epi8(a, zero), _mm512_unpacklo_epi8(b, zero), fxLo);
+		__m512i topHi = lerpAvx512(_mm512_unpackhi_epi8(a, zero), _mm512_unpackhi_epi8(b, zero), fxHi);
+		__m512i bottomLo = lerpAvx512(_mm512_unpacklo_epi8(c, zero), _mm512_unpacklo_epi8(d, zero), fxLo);
+		__m512i bottomHi = lerpAvx512(_mm512_unpackhi_epi8(c, zero), _mm512_unpackhi_epi8(d, zero), fxHi);
+
+		__m512i lo = lerpAvx512(topLo, bottomLo, fyv);
+		__m512i hi = lerpAvx512(topHi, bottomHi, fyv);
+		_mm512_mask_storeu_epi32(dst + i, mask, _mm512_packus_epi16(lo, hi));
+		x = _mm512_add_epi32(x, step);
+	}
+}
+
+// Up to four adjacent pixels, all channels, as 32-bit lanes
+static inline __m512i unpackPixelQuadAvx512(const uint32_t *pixels, __mmask64 byteMask)
+{
+	return _mm512_cvtepu8_epi32(_mm512_castsi512_si128(_mm512_maskz_loadu_epi8(byteMask, pixels)));
+}
+
+// Four columns side by side per register. The running sum along a row is
+// serial, so rows use the SSE2 kernel.
+static void boxBlurColumnsAvx512(uint32_t *dst, ptrdiff_t dstStride, const uint32_t *src, ptrdiff_t srcStride, int columns, int rows, int radius)
+{
+	__m512i scale = _mm512_set1_epi32(int(boxBlurScale(radius)));
+	__m512i half = _mm512_set1_epi64(0x80000000);
+	int last = rows - 1;
+
+	for (int x = 0; rows > 0 && x < columns; x += 4)
+	{
+		int width = columns - x < 4 ? columns - x : 4;
+		__mmask16 laneMask = tailMask(width * 4);
+		__mmask64 byteMask = width == 4 ? __mmask64(0xffff) : (__mmask64(1) << (width * 4)) - 1;
+
+		const uint32_t *column = src + x;
+		__m512i sum = _mm512_mullo_epi32(unpackPixelQuadAvx512(column, byteMask), _mm512_set1_epi32(radius + 1));
+		for (int i = 1; i <= radius; ++i)
+			sum = _mm512_add_epi32(sum, unpackPixelQuadAvx512(column + (i < last ? i : last) * srcStride, byteMask));
+
+		for (int i = 0; i < rows; ++i)
+		{
+			// boxBlurDivide, with the odd lanes multiplied shifted down
+			__m512i even = _mm512_add_epi64(_mm512_mul_epu32(sum, scale), half);
+			__m512i odd = _mm512_add_epi64(_mm512_mul_epu32(_mm512_srli_epi64(sum, 32), scale), half);
+			__m512i value = _mm512_mask_blend_epi32(0xaaaa, _mm512_srli_epi64(even, 32), odd);
+			_mm512_mask_cvtusepi32_storeu_epi8(dst + i * dstStride + x, laneMask, value);
+
+			int add = i + radius + 1;
+			int remove = i - radius;
+			sum = _mm512_add_epi32(sum, unpackPixelQuadAvx512(column + (add < last ? add : last) * srcStride, byteMask));
+			sum = _mm512_sub_epi32(sum, unpackPixelQuadAvx512(column + (remove > 0 ? remove : 0) * srcStride, byteMask));
+		}
+	}
+}
+
+const KernelTable &GdiKernels::avx512()
+{
+	static const KernelTable table = {
+		fillAvx512,
+		blendColorAvx512,
+		blendAvx512,
+		blendOpacityAvx512,
+		blitAvx512,
+		clearAvx512,
+		swapRedBlueAvx512,
+		linearGradientAvx512,
+		radialGradientAvx512,
+		scaleNearestAvx512,
+		scaleBilinearAvx512,
+		GdiKernels::sse2().boxBlurRow,
+		boxBlurColumnsAvx512,
+
+		// Rasterizer spans are one 8 pixel block row, which AVX2 covers
+		GdiKernels::avx2().triangleSpan,
+	};
+	return table;
+}
+
+}
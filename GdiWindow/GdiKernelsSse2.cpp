@@ -0,0 +1,365 @@
+#include "GdiKernels.h"
+
+#include <emmintrin.h>
+
+namespace GdiWindow
+{
+
+// (x + 128) / 255 rounded, for 16-bit lanes holding up to 255 * 255
+static inline __m128i div255Sse2(__m128i x)
+{
+	x = _mm_add_epi16(x, _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+static void fillSse2(uint32_t *dst, int count, uint32_t color)
+{
+	__m128i c = _mm_set1_epi32(int(color));
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+		_mm_storeu_si128((__m128i *)(dst + i), c);
+
+	GdiKernels::scalar().fill(dst + i, count - i, color);
+}
+
+static void blendColorSse2(uint32_t *dst, int count, uint32_t color)
+{
+	uint32_t a = color >> 24;
+	__m128i zero = _mm_setzero_si128();
+	__m128i inv = _mm_set1_epi16(short(255 - a));
+	__m128i src = _mm_unpacklo_epi8(_mm_set1_epi32(int(color | 0xff000000)), zero);
+	src = _mm_mullo_epi16(src, _mm_set1_epi16(short(a)));
+
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+		__m128i lo = div255Sse2(_mm_add_epi16(src, _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), inv)));
+		__m128i hi = div255Sse2(_mm_add_epi16(src, _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), inv)));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+	}
+
+	GdiKernels::scalar().blendColor(dst + i, count - i, color);
+}
+
+static inline __m128i inverseAlphaSse2(__m128i pixels16)
+{
+	__m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(pixels16, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+	return _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+}
+
+static void blendSse2(uint32_t *dst, const uint32_t *src, int count)
+{
+	__m128i zero = _mm_setzero_si128();
+
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+
+		__m128i lo = div255Sse2(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), inverseAlphaSse2(_mm_unpacklo_epi8(s, zero))));
+		__m128i hi = div255Sse2(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), inverseAlphaSse2(_mm_unpackhi_epi8(s, zero))));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epu8(s, _mm_packus_epi16(lo, hi)));
+	}
+
+	GdiKernels::scalar().blend(dst + i, src + i, count - i);
+}
+
+static void blendOpacitySse2(uint32_t *dst, const uint32_t *src, int count, uint32_t opacity)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i scale = _mm_set1_epi16(short(opacity));
+
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+
+		__m128i sLo = div255Sse2(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), scale));
+		__m128i sHi = div255Sse2(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), scale));
+		__m128i lo = _mm_add_epi16(sLo, div255Sse2(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), inverseAlphaSse2(sLo))));
+		__m128i hi = _mm_add_epi16(sHi, div255Sse2(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), inverseAlphaSse2(sHi))));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+	}
+
+	GdiKernels::scalar().blendOpacity(dst + i, src + i, count - i, opacity);
+}
+
+static void blitSse2(uint32_t *dst, const uint32_t *src, int count)
+{
+	int i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i + 4));
+		_mm_storeu_si128((__m128i *)(dst + i), a);
+		_mm_storeu_si128((__m128i *)(dst + i + 4), b);
+	}
+
+	GdiKernels::scalar().blit(dst + i, src + i, count - i);
+}
+
+static void clearSse2(uint32_t *dst, size_t count, uint32_t color)
+{
+	size_t i = 0;
+	while (i < count && (uintptr_t(dst + i) & 15) != 0)
+		dst[i++] = color;
+
+	__m128i c = _mm_set1_epi32(int(color));
+	for (; i + 4 <= count; i += 4)
+		_mm_stream_si128((__m128i *)(dst + i), c);
+
+	_mm_sfence();
+
+	GdiKernels::scalar().clear(dst + i, count - i, color);
+}
+
+static void swapRedBlueSse2(uint32_t *dst, const uint32_t *src, int count)
+{
+	__m128i greenAlpha = _mm_set1_epi32(int(0xff00ff00));
+	__m128i low = _mm_set1_epi32(0xff);
+
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i c = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i result = _mm_or_si128(
+			_mm_and_si128(c, greenAlpha),
+			_mm_or_si128(_mm_and_si128(_mm_srli_epi32(c, 16), low), _mm_slli_epi32(_mm_and_si128(c, low), 16)));
+		_mm_storeu_si128((__m128i *)(dst + i), result);
+	}
+
+	GdiKernels::scalar().swapRedBlue(dst + i, src + i, count - i);
+}
+
+static inline __m128i lutLookupSse2(const uint32_t *lut, __m128 t)
+{
+	t = _mm_min_ps(_mm_max_ps(t, _mm_setzero_ps()), _mm_set1_ps(float(GradientLut::Size - 1)));
+	__m128i index = _mm_cvttps_epi32(_mm_add_ps(t, _mm_set1_ps(0.5f)));
+
+	alignas(16) int32_t i[4];
+	_mm_store_si128((__m128i *)i, index);
+	return _mm_set_epi32(int(lut[i[3]]), int(lut[i[2]]), int(lut[i[1]]), int(lut[i[0]]));
+}
+
+static void linearGradientSse2(uint32_t *dst, int count, float t0, float dt, const uint32_t *lut)
+{
+	__m128 t0v = _mm_set1_ps(t0);
+	__m128 dtv = _mm_set1_ps(dt);
+	__m128 index = _mm_set_ps(3, 2, 1, 0);
+	__m128 step = _mm_set1_ps(4);
+
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		_mm_storeu_si128((__m128i *)(dst + i), lutLookupSse2(lut, _mm_add_ps(t0v, _mm_mul_ps(dtv, index))));
+		index = _mm_add_ps(index, step);
+	}
+
+	GdiKernels::scalar().linearGradient(dst + i, count - i, t0 + dt * float(i), dt, lut);
+}
+
+static void radialGradientSse2(uint32_t *dst, int count, float dx0, float dy2, float scale, const uint32_t *lut)
+{
+	__m128 dx = _mm_add_ps(_mm_set1_ps(dx0), _mm_set_ps(3, 2, 1, 0));
+	__m128 dy2v = _mm_set1_ps(dy2);
+	__m128 scalev = _mm_set1_ps(scale);
+	__m128 step = _mm_set1_ps(4);
+
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 dist = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), dy2v));
+		_mm_storeu_si128((__m128i *)(dst + i), lutLookupSse2(lut, _mm_mul_ps(dist, scalev)));
+		dx = _mm_add_ps(dx, step);
+	}
+
+	GdiKernels::scalar().radialGradient(dst + i, count - i, dx0 + float(i), dy2, scale, lut);
+}
+
+// (a * (256 - t) + b * t) / 256 for 16-bit lanes of 8-bit values
+static inline __m128i lerpSse2(__m128i a, __m128i b, __m128i t)
+{
+	__m128i inv = _mm_sub_epi16(_mm_set1_epi16(256), t);
+	return _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(a, inv), _mm_mullo_epi16(b, t)), 8);
+}
+
+static void scaleBilinearSse2(uint32_t *dst, int count, const uint32_t *row0, const uint32_t *row1, int srcCount, int x0, int dx, uint32_t fy)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i fyv = _mm_set1_epi16(short(fy));
+
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		// No gather before AVX2, so the taps are fetched one by one
+		alignas(16) uint32_t p00[4], p01[4], p10[4], p11[4];
+		alignas(16) uint16_t fx[8];
+		for (int j = 0; j < 4; ++j)
+		{
+			int x = clampScalePosition(x0 + dx * (i + j), srcCount);
+			int ix = x >> 16;
+			int ix1 = ix + 1 < srcCount ? ix + 1 : ix;
+			p00[j] = row0[ix];
+			p01[j] = row0[ix1];
+			p10[j] = row1[ix];
+			p11[j] = row1[ix1];
+			fx[j] = uint16_t(x >> 8 & 0xff);
+		}
+
+		__m128i fxLo = _mm_set_epi16(fx[1], fx[1], fx[1], fx[1], fx[0], fx[0], fx[0], fx[0]);
+		__m128i fxHi = _mm_set_epi16(fx[3], fx[3], fx[3], fx[3], fx[2], fx[2], fx[2], fx[2]);
+
+		__m128i a = _mm_load_si128((const __m128i *)p00);
+		__m128i b = _mm_load_si128((const __m128i *)p01);
+		__m128i c = _mm_load_si128((const __m128i *)p10);
+		__m128i d = _mm_load_si128((const __m128i *)p11);
+
+		__m128i topLo = lerpSse2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), fxLo);
+		__m128i topHi = lerpSse2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), fxHi);
+		__m128i bottomLo = lerpSse2(_mm_unpacklo_epi8(c, zero), _mm_unpacklo_epi8(d, zero), fxLo);
+		__m128i bottomHi = lerpSse2(_mm_unpackhi_epi8(c, zero), _mm_unpackhi_epi8(d, zero), fxHi);
+
+		__m128i lo = lerpSse2(topLo, bottomLo, fyv);
+		__m128i hi = lerpSse2(topHi, bottomHi, fyv);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+	}
+
+	GdiKernels::scalar().scaleBilinear(dst + i, count - i, row0, row1, srcCount, x0 + dx * i, dx, fy);
+}
+
+static inline __m128i unpackPixelSse2(uint32_t pixel)
+{
+	__m128i zero = _mm_setzero_si128();
+	return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(int(pixel)), zero), zero);
+}
+
+// boxBlurDivide on four 32-bit sums. SSE2 only multiplies the even lanes,
+// so the odd ones are shifted down and their high halves put back in place.
+static inline uint32_t boxBlurPackSse2(__m128i sum, __m128i scale)
+{
+	__m128i half = _mm_set1_epi64x(0x80000000);
+	__m128i even = _mm_add_epi64(_mm_mul_epu32(sum, scale), half);
+	__m128i odd = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(sum, 32), scale), half);
+	__m128i x = _mm_or_si128(_mm_srli_epi64(even, 32), _mm_and_si128(odd, _mm_set1_epi64x(int64_t(0xffffffff00000000))));
+
+	x = _mm_packs_epi32(x, x);
+	return uint32_t(_mm_cvtsi128_si32(_mm_packus_epi16(x, x)));
+}
+
+// All four channels of a pixel in one register
+static void boxBlurLineSse2(uint32_t *dst, ptrdiff_t dstStep, const uint32_t *src, ptrdiff_t srcStep, int count, int radius)
+{
+	__m128i scale = _mm_set1_epi32(int(boxBlurScale(radius)));
+	int last = count - 1;
+
+	__m128i sum = _mm_madd_epi16(unpackPixelSse2(src[0]), _mm_set1_epi32(radius + 1));
+	for (int i = 1; i <= radius; ++i)
+		sum = _mm_add_epi32(sum, unpackPixelSse2(src[(i < last ? i : last) * srcStep]));
+
+	for (int i = 0; i < count; ++i)
+	{
+		dst[i * dstStep] = boxBlurPackSse2(sum, scale);
+
+		int add = i + radius + 1;
+		int remove = i - radius;
+		sum = _mm_add_epi32(sum, unpackPixelSse2(src[(add < last ? add : last) * srcStep]));
+		sum = _mm_sub_epi32(sum, unpackPixelSse2(src[(remove > 0 ? remove : 0) * srcStep]));
+	}
+}
+
+static void boxBlurRowSse2(uint32_t *dst, const uint32_t *src, int count, int radius)
+{
+	if (count > 0)
+		boxBlurLineSse2(dst, 1, src, 1, count, radius);
+}
+
+static void boxBlurColumnsSse2(uint32_t *dst, ptrdiff_t dstStride, const uint32_t *src, ptrdiff_t srcStride, int columns, int rows, int radius)
+{
+	for (int x = 0; rows > 0 && x < columns; ++x)
+		boxBlurLineSse2(dst + x, dstStride, src + x, srcStride, rows, radius);
+}
+
+// value, value + step, value + 2 * step, value + 3 * step
+static inline __m128i spanLanesSse2(int32_t value, int32_t step)
+{
+	uint32_t v = uint32_t(value);
+	uint32_t s = uint32_t(step);
+	return _mm_setr_epi32(int(v), int(v + s), int(v + 2 * s), int(v + 3 * s));
+}
+
+// Four pixels per step. Groups no edge covers are skipped; partly covered
+// ones keep dst where an edge is negative.
+static void triangleSpanSse2(uint32_t *dst, int count, const TriangleSpan &span)
+{
+	__m128i edges[3], edgeSteps[3], colors[4], colorSteps[4];
+	for (int k = 0; k < 3; ++k)
+	{
+		edges[k] = spanLanesSse2(span.edges[k], span.edgeSteps[k]);
+		edgeSteps[k] = _mm_set1_epi32(int(uint32_t(span.edgeSteps[k]) * 4));
+	}
+	for (int c = 0; c < 4; ++c)
+	{
+		colors[c] = spanLanesSse2(span.colors[c], span.colorSteps[c]);
+		colorSteps[c] = _mm_set1_epi32(int(uint32_t(span.colorSteps[c]) * 4));
+	}
+
+	__m128i zero = _mm_setzero_si128();
+
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i outside = _mm_srai_epi32(_mm_or_si128(_mm_or_si128(edges[0], edges[1]), edges[2]), 31);
+		if (_mm_movemask_epi8(outside) != 0xffff)
+		{
+			// Saturating packs clamp the channels: B0-3 G0-3 R0-3 A0-3, then
+			// interleaved into pixels
+			__m128i bg = _mm_packs_epi32(_mm_srai_epi32(colors[0], 16), _mm_srai_epi32(colors[1], 16));
+			__m128i ra = _mm_packs_epi32(_mm_srai_epi32(colors[2], 16), _mm_srai_epi32(colors[3], 16));
+			__m128i planar = _mm_packus_epi16(bg, ra);
+			__m128i pairsBg = _mm_unpacklo_epi8(planar, _mm_srli_si128(planar, 4));
+			__m128i pairsRa = _mm_unpacklo_epi8(_mm_srli_si128(planar, 8), _mm_srli_si128(planar, 12));
+			__m128i s = _mm_unpacklo_epi16(pairsBg, pairsRa);
+
+			__m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+			__m128i lo = div255Sse2(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), inverseAlphaSse2(_mm_unpacklo_epi8(s, zero))));
+			__m128i hi = div255Sse2(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), inverseAlphaSse2(_mm_unpackhi_epi8(s, zero))));
+			__m128i blended = _mm_adds_epu8(s, _mm_packus_epi16(lo, hi));
+			_mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(_mm_and_si128(outside, d), _mm_andnot_si128(outside, blended)));
+		}
+
+		for (int k = 0; k < 3; ++k)
+			edges[k] = _mm_add_epi32(edges[k], edgeSteps[k]);
+		for (int c = 0; c < 4; ++c)
+			colors[c] = _mm_add_epi32(colors[c], colorSteps[c]);
+	}
+
+	GdiKernels::scalar().triangleSpan(dst + i, count - i, advanceTriangleSpan(span, i));
+}
+
+const KernelTable &GdiKernels::sse2()
+{
+	static const KernelTable table = {
+		fillSse2,
+		blendColorSse2,
+		blendSse2,
+		blendOpacitySse2,
+		blitSse2,
+		clearSse2,
+		swapRedBlueSse2,
+		linearGradientSse2,
+		radialGradientSse2,
+
+		// A scalar index per pixel is all nearest needs without a gather
+		GdiKernels::scalar().scaleNearest,
+		scaleBilinearSse2,
+		boxBlurRowSse2,
+		boxBlurColumnsSse2,
+		triangleSpanSse2,
+	};
+	return table;
+}
+
+}
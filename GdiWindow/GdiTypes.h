@@ -1,5 +1,8 @@
 #pragma once
 
+#include <inttypes.h>
+#include <stddef.h>
+
 namespace GdiWindow
 {
 
@@ -29,6 +32,29 @@ struct Col
 
 	static Col black() { return Col(0, 0, 0, 1); }
 	static Col white() { return Col(1, 1, 1, 1); }
+
+	// 32-bit BGRA as stored in the window buffer
+	uint32_t toBgra() const
+	{
+		return uint32_t(toByte(b)) | uint32_t(toByte(g)) << 8 | uint32_t(toByte(r)) << 16 | uint32_t(toByte(a)) << 24;
+	}
+
+	static uint8_t toByte(float v)
+	{
+		return v <= 0 ? 0 : v >= 1 ? 255 : uint8_t(v * 255 + 0.5f);
+	}
+};
+
+// A view of 32-bit BGRA pixels. Rows are addressed top-down; stride is in
+// pixels and negative when the memory is bottom-up, as with the window DIB.
+struct Surface
+{
+	uint32_t *pixels = nullptr;
+	int w = 0;
+	int h = 0;
+	int stride = 0;
+
+	uint32_t *row(int y) const { return pixels + ptrdiff_t(y) * stride; }
 };
 
 void sleepImpl(float ms);
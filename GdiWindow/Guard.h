@@ -1,11 +1,25 @@
 #pragma once
 
+#include "Trace.h"
+
 #include <mutex>
 #include <assert.h>
 
 namespace GdiWindow
 {
 
+// Only a lock that has to wait shows up in the trace
+inline void lockTraced(std::mutex &m)
+{
+#ifdef GDIWINDOW_TRACE
+	if (m.try_lock())
+		return;
+
+	TRACE_ZONE("Lock wait");
+#endif
+	m.lock();
+}
+
 template<typename T>
 struct Ref
 {	
@@ -13,7 +27,7 @@ struct Ref
 		: m(&m)
 		, t(&t)
 	{
-		m.lock();
+		lockTraced(m);
 	}
 
 	Ref(const Ref &o) = delete;
@@ -174,7 +188,7 @@ struct InverseMutexGuard
 
 	~InverseMutexGuard()
 	{
-		mutex.lock();
+		lockTraced(mutex);
 	}
 
 	std::mutex &mutex;
@@ -0,0 +1,166 @@
+#include "HitIndex.h"
+
+#include <math.h>
+
+namespace GdiWindow
+{
+
+static const int CellShift = 5;
+static const int CellSize = 1 << CellShift;
+
+// Shapes covering more cells than this go to the large list
+static const int MaxCellsPerShape = 64;
+
+struct CellRange
+{
+	int x0, y0, x1, y1;
+
+	int count() const { return (x1 - x0) * (y1 - y0); }
+};
+
+static CellRange getCells(const IntRect &bounds, int columns, int rows)
+{
+	CellRange range;
+	range.x0 = bounds.x >> CellShift;
+	range.y0 = bounds.y >> CellShift;
+	range.x1 = ((bounds.x + bounds.w - 1) >> CellShift) + 1;
+	range.y1 = ((bounds.y + bounds.h - 1) >> CellShift) + 1;
+
+	range.x0 = range.x0 < 0 ? 0 : range.x0;
+	range.y0 = range.y0 < 0 ? 0 : range.y0;
+	range.x1 = range.x1 > columns ? columns : range.x1;
+	range.y1 = range.y1 > rows ? rows : range.y1;
+	if (range.x1 < range.x0)
+		range.x1 = range.x0;
+	if (range.y1 < range.y0)
+		range.y1 = range.y0;
+	return range;
+}
+
+void HitIndex::build(std::vector<HitShape> &newShapes, int w, int h)
+{
+	shapes.swap(newShapes);
+	newShapes.clear();
+
+	cellShapes.clear();
+	largeShapes.clear();
+	if (shapes.empty())
+		return;
+
+	columns = w > 0 ? (w + CellSize - 1) >> CellShift : 0;
+	rows = h > 0 ? (h + CellSize - 1) >> CellShift : 0;
+	cellStarts.assign(size_t(columns) * size_t(rows) + 1, 0);
+
+	// Count per cell, turn the counts into starts, then fill in order
+	for (size_t i = 0; i < shapes.size(); ++i)
+	{
+		CellRange range = getCells(shapes[i].bounds, columns, rows);
+		if (range.count() > MaxCellsPerShape)
+			continue;
+
+		for (int y = range.y0; y < range.y1; ++y)
+			for (int x = range.x0; x < range.x1; ++x)
+				cellStarts[size_t(y) * columns + x + 1] += 1;
+	}
+
+	for (size_t i = 1; i < cellStarts.size(); ++i)
+		cellStarts[i] += cellStarts[i - 1];
+
+	cellShapes.resize(cellStarts.back());
+	cellFill.assign(cellStarts.begin(), cellStarts.end() - 1);
+	for (size_t i = 0; i < shapes.size(); ++i)
+	{
+		CellRange range = getCells(shapes[i].bounds, columns, rows);
+		if (range.count() > MaxCellsPerShape)
+		{
+			largeShapes.push_back(uint32_t(i));
+			continue;
+		}
+
+		for (int y = range.y0; y < range.y1; ++y)
+			for (int x = range.x0; x < range.x1; ++x)
+				cellShapes[cellFill[size_t(y) * columns + x]++] = uint32_t(i);
+	}
+}
+
+void HitIndex::reserve(int w, int h)
+{
+	size_t cells = size_t(w > 0 ? (w + CellSize - 1) >> CellShift : 0) * size_t(h > 0 ? (h + CellSize - 1) >> CellShift : 0);
+	cellStarts.reserve(cells + 1);
+	cellFill.reserve(cells);
+}
+
+void HitIndex::clear()
+{
+	shapes.clear();
+	columns = 0;
+	rows = 0;
+	cellStarts.clear();
+	cellShapes.clear();
+	cellFill.clear();
+	largeShapes.clear();
+}
+
+static float cross(Vec2 a, Vec2 b, float x, float y)
+{
+	return (b.x - a.x) * (y - a.y) - (b.y - a.y) * (x - a.x);
+}
+
+static bool contains(const HitShape &shape, int px, int py)
+{
+	const IntRect &b = shape.bounds;
+	if (px < b.x || py < b.y || px >= b.x + b.w || py >= b.y + b.h)
+		return false;
+
+	if (!shape.triangle)
+		return true;
+
+	// Either winding, with points on an edge inside
+	float x = float(px) + 0.5f;
+	float y = float(py) + 0.5f;
+	float e0 = cross(shape.corners[0], shape.corners[1], x, y);
+	float e1 = cross(shape.corners[1], shape.corners[2], x, y);
+	float e2 = cross(shape.corners[2], shape.corners[0], x, y);
+	return (e0 >= 0 && e1 >= 0 && e2 >= 0) || (e0 <= 0 && e1 <= 0 && e2 <= 0);
+}
+
+uint32_t HitIndex::query(float x, float y) const
+{
+	if (shapes.empty() || !(x >= 0 && y >= 0))
+		return 0;
+
+	int px = int(floorf(x));
+	int py = int(floorf(y));
+	int column = px >> CellShift;
+	int row = py >> CellShift;
+	if (column >= columns || row >= rows)
+		return 0;
+
+	// Both lists are in drawing order, so the first hit from the back of
+	// each is its topmost and the later of the two wins
+	int64_t best = -1;
+	size_t cell = size_t(row) * columns + column;
+	for (uint32_t i = cellStarts[cell + 1]; i > cellStarts[cell]; --i)
+	{
+		uint32_t index = cellShapes[i - 1];
+		if (contains(shapes[index], px, py))
+		{
+			best = index;
+			break;
+		}
+	}
+
+	for (size_t i = largeShapes.size(); i > 0 && int64_t(largeShapes[i - 1]) > best; --i)
+	{
+		uint32_t index = largeShapes[i - 1];
+		if (contains(shapes[index], px, py))
+		{
+			best = index;
+			break;
+		}
+	}
+
+	return best >= 0 ? shapes[size_t(best)].id : 0;
+}
+
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "GdiKernels.h"
+
+#include <vector>
+
+namespace GdiWindow
+{
+
+// A primitive recorded for hit testing, in draw buffer pixels. Triangles
+// also test the point against their corners.
+struct HitShape
+{
+	IntRect bounds;
+	uint32_t id = 0;
+	bool triangle = false;
+	Vec2 corners[3];
+};
+
+// Uniform grid over the shapes of a frame. Later shapes are on top. Each
+// cell lists the shapes overlapping it in drawing order; shapes covering
+// many cells, like backgrounds, are kept in one list beside the grid instead
+// of in every cell.
+struct HitIndex
+{
+	// Takes the shapes, leaving the vector empty, and indexes them over a
+	// buffer of w x h pixels. Memory is kept between builds.
+	void build(std::vector<HitShape> &newShapes, int w, int h);
+	void clear();
+
+	// Sizes the grid for buffers of up to w x h pixels, so builds for them do
+	// not allocate
+	void reserve(int w, int h);
+
+	// The id of the topmost shape containing the pixel under (x, y), or zero
+	uint32_t query(float x, float y) const;
+
+	std::vector<HitShape> shapes;
+
+	int columns = 0;
+	int rows = 0;
+	std::vector<uint32_t> cellStarts;
+	std::vector<uint32_t> cellShapes;
+	std::vector<uint32_t> largeShapes;
+
+	// Where build writes the next shape of each cell
+	std::vector<uint32_t> cellFill;
+};
+
+}
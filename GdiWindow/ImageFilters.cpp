@@ -0,0 +1,245 @@
+#include "ImageFilters.h"
+
+#include "FrameArena.h"
+#include "GdiKernels.h"
+#include "Guard.h"
+#include "Trace.h"
+#include "WorkerThreads.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <math.h>
+#include <string.h>
+
+namespace GdiWindow
+{
+
+static const int MaxFilterThreads = 8;
+
+// Rows per job of the row pass and columns per strip of the column pass.
+// A strip of a tall buffer still fits in L2.
+static const int RowsPerJob = 16;
+static const int ColumnsPerStrip = 32;
+
+// A parallel for loop over count indices. Lives on the submitting thread's
+// stack until every thread has let go of it. Each thread that takes part
+// gets its own slot, below getThreadCount(), for per-thread scratch.
+struct FilterJob
+{
+	void (*run)(void *context, int index, int slot) = nullptr;
+	void *context = nullptr;
+	int count = 0;
+	std::atomic<int> next{ 0 };
+	std::atomic<int> nextSlot{ 0 };
+};
+
+struct FilterWorkers
+{
+	bool started = false;
+	int threadCount = 0;
+
+	FilterJob *job = nullptr;
+	uint64_t generation = 0;
+	int busy = 0;
+	std::condition_variable changed;
+	std::condition_variable finished;
+};
+
+static Guard<FilterWorkers> &getFilterWorkers()
+{
+	return getWorkerState<FilterWorkers>();
+}
+
+static void runJob(FilterJob &job)
+{
+	int slot = job.nextSlot++;
+	for (int i = job.next++; i < job.count; i = job.next++)
+		job.run(job.context, i, slot);
+}
+
+static void filterThread()
+{
+	Trace::setThreadName("Image filters");
+
+	Guard<FilterWorkers> &workers = getFilterWorkers();
+	std::unique_lock<std::mutex> lock(workers.m);
+	uint64_t seen = 0;
+	while (true)
+	{
+		workers.t.changed.wait(lock, [&] { return workers.t.job && workers.t.generation != seen; });
+		seen = workers.t.generation;
+
+		FilterJob *job = workers.t.job;
+		workers.t.busy += 1;
+		lock.unlock();
+		runJob(*job);
+		lock.lock();
+		workers.t.busy -= 1;
+		workers.t.finished.notify_all();
+	}
+}
+
+static int startFilterWorkers()
+{
+	Ref<FilterWorkers> workers = getFilterWorkers();
+	if (!workers->started)
+	{
+		workers->threadCount = WorkerThreads::getPoolSize(0, MaxFilterThreads);
+		WorkerThreads::start(workers->started, workers->threadCount, &filterThread);
+	}
+
+	return workers->threadCount;
+}
+
+static void parallelFor(int count, void (*run)(void *context, int index, int slot), void *context)
+{
+	FilterJob job;
+	job.run = run;
+	job.context = context;
+	job.count = count;
+
+	// One job runs at a time; callers from several windows take turns
+	static std::mutex submitMutex;
+	if (count <= 1 || startFilterWorkers() == 0)
+	{
+		runJob(job);
+		return;
+	}
+
+	std::lock_guard<std::mutex> submitLock(submitMutex);
+	{
+		Ref<FilterWorkers> workers = getFilterWorkers();
+		workers->job = &job;
+		workers->generation += 1;
+		workers->changed.notify_all();
+	}
+
+	runJob(job);
+
+	Ref<FilterWorkers> workers = getFilterWorkers();
+	workers->job = nullptr;
+
+	std::unique_lock<std::mutex> lock(*workers.m, std::adopt_lock);
+	workers->finished.wait(lock, [&] { return workers->busy == 0; });
+	lock.release();
+}
+
+struct BoxBlurPass
+{
+	const Surface *surface;
+	const KernelTable *kernels;
+	int radius;
+
+	// scratchSize pixels per slot
+	uint32_t *scratch;
+	size_t scratchSize;
+};
+
+// Enough for a row or a column strip of the surface
+static size_t getScratchSize(const Surface &surface)
+{
+	return std::max(size_t(surface.w), size_t(std::min(ColumnsPerStrip, surface.w)) * size_t(surface.h));
+}
+
+static void blurRows(void *context, int index, int slot)
+{
+	const BoxBlurPass &pass = *(const BoxBlurPass *)context;
+	const Surface &surface = *pass.surface;
+	uint32_t *scratch = pass.scratch + size_t(slot) * pass.scratchSize;
+
+	int end = std::min(surface.h, (index + 1) * RowsPerJob);
+	for (int y = index * RowsPerJob; y < end; ++y)
+	{
+		memcpy(scratch, surface.row(y), size_t(surface.w) * sizeof(uint32_t));
+		pass.kernels->boxBlurRow(surface.row(y), scratch, surface.w, pass.radius);
+	}
+}
+
+static void blurColumns(void *context, int index, int slot)
+{
+	const BoxBlurPass &pass = *(const BoxBlurPass *)context;
+	const Surface &surface = *pass.surface;
+
+	int x = index * ColumnsPerStrip;
+	int columns = std::min(ColumnsPerStrip, surface.w - x);
+	uint32_t *scratch = pass.scratch + size_t(slot) * pass.scratchSize;
+
+	for (int y = 0; y < surface.h; ++y)
+		memcpy(scratch + size_t(y) * columns, surface.row(y) + x, size_t(columns) * sizeof(uint32_t));
+
+	pass.kernels->boxBlurColumns(surface.row(0) + x, surface.stride, scratch, columns, columns, surface.h, pass.radius);
+}
+
+static uint32_t *allocateScratch(const Surface &surface, FrameArena &arena)
+{
+	return arena.allocateArray<uint32_t>(size_t(ImageFilters::getThreadCount()) * getScratchSize(surface));
+}
+
+static void boxBlurWithScratch(const Surface &surface, int radius, uint32_t *scratch)
+{
+	TRACE_ZONE("boxBlur");
+
+	// Radii past the size of the surface are clamped to it, which bounds the
+	// work per line and keeps sums within 32 bits. With the edges repeated
+	// larger radii would still shift the result towards the edge pixels, so
+	// this is an approximation for them.
+	int limit = std::max(surface.w, surface.h);
+	limit = std::min(limit, 32767);
+	BoxBlurPass pass = { &surface, &GdiKernels::get(), radius < limit ? radius : limit, scratch, getScratchSize(surface) };
+
+	parallelFor((surface.h + RowsPerJob - 1) / RowsPerJob, &blurRows, &pass);
+	parallelFor((surface.w + ColumnsPerStrip - 1) / ColumnsPerStrip, &blurColumns, &pass);
+}
+
+void ImageFilters::boxBlur(const Surface &surface, int radius, FrameArena &arena)
+{
+	if (radius <= 0 || surface.w <= 0 || surface.h <= 0)
+		return;
+
+	boxBlurWithScratch(surface, radius, allocateScratch(surface, arena));
+}
+
+void ImageFilters::getGaussianBoxRadii(float sigma, int radii[3])
+{
+	// Box widths whose variances add up to sigma^2, as in "Fast Almost-Gaussian
+	// Filtering" by W. Jarosz
+	const int Passes = 3;
+	float ideal = sqrtf(12.0f * sigma * sigma / Passes + 1.0f);
+	int lower = int(floorf(ideal));
+	if (lower % 2 == 0)
+		lower -= 1;
+	int upper = lower + 2;
+
+	float idealLowerCount = (12.0f * sigma * sigma - Passes * lower * lower - 4.0f * Passes * lower - 3.0f * Passes) / (-4.0f * lower - 4.0f);
+	int lowerCount = int(floorf(idealLowerCount + 0.5f));
+
+	for (int i = 0; i < Passes; ++i)
+		radii[i] = ((i < lowerCount ? lower : upper) - 1) / 2;
+}
+
+void ImageFilters::gaussianBlur(const Surface &surface, float sigma, FrameArena &arena)
+{
+	if (!(sigma > 0) || surface.w <= 0 || surface.h <= 0)
+		return;
+
+	TRACE_ZONE("gaussianBlur");
+
+	// The three passes share one scratch
+	uint32_t *scratch = allocateScratch(surface, arena);
+
+	int radii[3];
+	getGaussianBoxRadii(sigma, radii);
+	for (int radius : radii)
+	{
+		if (radius > 0)
+			boxBlurWithScratch(surface, radius, scratch);
+	}
+}
+
+int ImageFilters::getThreadCount()
+{
+	return startFilterWorkers() + 1;
+}
+
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "GdiTypes.h"
+
+namespace GdiWindow
+{
+
+struct FrameArena;
+
+// Separable filters that work in place on a Surface, which may be a sub-rect
+// of a larger one. Pixels past the edges of the surface repeat its border.
+// Rows and then columns are split across a pool of filter threads, with the
+// calling thread taking part, so calls block until the result is ready.
+// Scratch for one row or column strip per thread comes from the arena, sized
+// up front, so the threads never allocate while they run.
+struct ImageFilters
+{
+	// Each pixel becomes the average of the (2 * radius + 1)^2 box around it
+	static void boxBlur(const Surface &surface, int radius, FrameArena &arena);
+
+	// Approximated with three box blurs
+	static void gaussianBlur(const Surface &surface, float sigma, FrameArena &arena);
+
+	// The radii of the box blurs gaussianBlur uses for sigma
+	static void getGaussianBoxRadii(float sigma, int radii[3]);
+
+	static int getThreadCount();
+};
+
+}
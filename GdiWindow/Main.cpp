@@ -1,18 +1,41 @@
 #include "Window.h"
 #include "GdiDrawing.h"
+#include "AllocationTracer.h"
+#include "FrameCapture.h"
+#include "FrameRecorder.h"
+#include "GdiKernels.h"
+#include "PixelPipeline.h"
+#include "RenderTask.h"
+#include "Trace.h"
 
+#include <algorithm>
+#include <atomic>
+#include <math.h>
+#include <random>
 #include <thread>
 #include <chrono>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
 
 using namespace GdiWindow;
 
+static const char *sharedMemoryName = nullptr;
+static float renderScale = 1;
+static float targetFrameMs = 0;
+
 static void initGdiDraw(const WindowHandle &windowHandle, void *hwnd)
 {
+	if (sharedMemoryName)
+		GdiDraw::setSharedMemoryName(hwnd, sharedMemoryName);
+
 	GdiDraw::init(hwnd);
 }
 
 static void deinitGdiDraw(const WindowHandle &windowHandle, void *hwnd)
 {
+	FrameRecorder::stop(hwnd);
+	FrameCapture::cancel(hwnd);
 	GdiDraw::deinit(hwnd);
 }
 
@@ -31,44 +54,559 @@ static void resized(const WindowHandle& windowHandle, void* hwnd)
 	GdiDraw::init(hwnd);
 }
 
+static void visibilityChanged(const WindowHandle &windowHandle, void *hwnd, bool visible)
+{
+	GdiDraw::setVisible(hwnd, visible);
+}
+
+// Hit ids of the demo's hoverable shapes
+enum DemoHitId : uint32_t
+{
+	HeatmapHit = 1,
+	MovingRectHit,
+};
+
+// What the mouse was last over, in any of the demo windows
+static std::atomic<uint32_t> hoveredId{ 0 };
+
 static int64_t message(const WindowHandle &windowHandle, void *hwnd, uint32_t msg, uint64_t wParam, int64_t lParam)
 {
+	const uint32_t MouseMoveMessage = 0x0200; // WM_MOUSEMOVE
+	if (msg == MouseMoveMessage)
+	{
+		Vec2 pos{ float(int16_t(lParam & 0xffff)), float(int16_t(lParam >> 16 & 0xffff)) };
+		hoveredId = GdiDraw::hitTest(hwnd, pos);
+	}
 	return 0;
 }
 
-static void doDrawing(WindowHandle h)
+struct DemoLayers
 {
-	while (Window::exists(h))
+	int background = 0;
+	int overlay = 0;
+};
+
+static void drawBackground(void *hwnd)
+{
+	GdiDraw::clear(hwnd, Col::black());
+
+	GdiDrawInfo info;
+	info.rect = Rect{ Vec2{ 100, 40 }, Vec2{ 60, 40 } };
+	info.col = Col(0, 1, 0.5f, 0.5f);
+	GdiDraw::draw(hwnd, info);
+
+	static const GradientStop stops[] = {
+		{ 0.0f, Col(0.1f, 0.1f, 0.2f) },
+		{ 0.6f, Col(0.2f, 0.4f, 0.8f) },
+		{ 1.0f, Col::white() },
+	};
+
+	LinearGradient linear;
+	linear.start = Vec2{ 0, 0 };
+	linear.end = Vec2{ 200, 0 };
+	linear.stops = stops;
+	linear.stopCount = 3;
+	GdiDraw::fillLinearGradient(hwnd, Rect{ Vec2{ 0, 0 }, Vec2{ 200, 20 } }, linear);
+
+	RadialGradient radial;
+	radial.center = Vec2{ 40, 60 };
+	radial.radius = 30;
+	radial.stops = stops;
+	radial.stopCount = 3;
+	GdiDraw::fillRadialGradient(hwnd, Rect{ Vec2{ 10, 30 }, Vec2{ 60, 60 } }, radial);
+
+	// Frosted backdrop for the clipped widget in the overlay
+	GdiDraw::gaussianBlur(hwnd, Rect{ Vec2{ 170, 30 }, Vec2{ 50, 50 } }, 4);
+}
+
+// An animated heatmap, one mesh of shared vertices submitted in one call
+static void drawHeatmap(void *hwnd, int frame)
+{
+	const int Columns = 8;
+	const int Rows = 4;
+	ColorVertex vertices[(Columns + 1) * (Rows + 1)];
+	uint32_t indices[Columns * Rows * 6];
+
+	for (int y = 0; y <= Rows; ++y)
+	{
+		for (int x = 0; x <= Columns; ++x)
+		{
+			float heat = 0.5f + 0.5f * sinf(float(x) * 0.8f + float(y) * 1.3f + float(frame) * 0.05f);
+			ColorVertex &vertex = vertices[y * (Columns + 1) + x];
+			vertex.pos = Vec2{ 10 + float(x) * 25, 110 + float(y) * 15 };
+			vertex.col = Col(heat, 0.2f, 1 - heat, 0.8f);
+		}
+	}
+
+	uint32_t *index = indices;
+	for (int y = 0; y < Rows; ++y)
+	{
+		for (int x = 0; x < Columns; ++x)
+		{
+			uint32_t topLeft = uint32_t(y * (Columns + 1) + x);
+			uint32_t bottomLeft = topLeft + Columns + 1;
+			uint32_t quad[6] = { topLeft, topLeft + 1, bottomLeft + 1, topLeft, bottomLeft + 1, bottomLeft };
+			for (uint32_t i : quad)
+				*index++ = i;
+		}
+	}
+
+	TriangleMesh mesh;
+	mesh.vertices = vertices;
+	mesh.vertexCount = (Columns + 1) * (Rows + 1);
+	mesh.indices = indices;
+	mesh.indexCount = Columns * Rows * 6;
+	GdiDraw::drawTriangles(hwnd, &mesh);
+}
+
+static void drawOverlay(void *hwnd, int frame)
+{
+	GdiDraw::setHitId(hwnd, HeatmapHit);
+	drawHeatmap(hwnd, frame);
+
+	// Lights up while the mouse is over it
+	GdiDrawInfo info;
+	info.rect = Rect{ Vec2{ float(frame % 200), 80 }, Vec2{ 40, 20 } };
+	info.col = hoveredId == MovingRectHit ? Col(1, 0.8f, 0.4f) : Col(1, 0.5f, 0);
+	GdiDraw::drawShadow(hwnd, info.rect, Vec2{ 3, 4 }, 3, Col(0, 0, 0, 0.6f));
+	GdiDraw::setHitId(hwnd, MovingRectHit);
+	GdiDraw::draw(hwnd, info);
+	GdiDraw::setHitId(hwnd, 0);
+
+	// A widget drawn in its own coordinates, clipped to its bounds
+	GdiDraw::pushTranslate(hwnd, Vec2{ 170, 30 });
+	GdiDraw::pushClip(hwnd, Rect{ Vec2{ 0, 0 }, Vec2{ 50, 50 } });
+	info.rect = Rect{ Vec2{ float(frame % 100) - 50, 10 }, Vec2{ 60, 30 } };
+	info.col = Col(0.8f, 0.2f, 0.2f);
+	GdiDraw::draw(hwnd, info);
+	GdiDraw::popClip(hwnd);
+	GdiDraw::popTransform(hwnd);
+}
+
+// The background is only redrawn after a resize; the overlay every frame
+static void drawFrame(void *hwnd, const DemoLayers &layers, int frame)
+{
+	if (GdiDraw::beginLayer(hwnd, layers.background))
 	{
-		void *hwnd = Window::getHwnd(h);
-		GdiDraw::beginDrawing(hwnd);
-		GdiDrawInfo info;
-		GdiDraw::draw(hwnd, info);
-		sleep(5);
-		GdiDraw::endDrawing(hwnd);
+		drawBackground(hwnd);
+		GdiDraw::endLayer(hwnd);
+	}
+
+	GdiDraw::invalidateLayer(hwnd, layers.overlay);
+	if (GdiDraw::beginLayer(hwnd, layers.overlay))
+	{
+		drawOverlay(hwnd, frame);
+		GdiDraw::endLayer(hwnd);
 	}
 }
 
-int main()
+static RenderTask renderLoop(WindowHandle h)
 {
-	WindowHandle h("asdf");
-	Window::registerStartedDelegate(h, &initGdiDraw);
-	Window::registerStoppingDelegate(h, &deinitGdiDraw);
-	Window::registerPaintDelegate(h, &paintGdiDraw);
-	Window::registerMoveDelegate(h, &moved);
-	Window::registerResizeDelegate(h, &resized);
-	Window::registerMessageDelegate(h, &message);
+	const int WarmupFrames = 10;
+
+	void *hwnd = co_await waitForOpenAsync(h);
+	if (!hwnd)
+		co_return;
 
-	Window::open(h);
+	DemoLayers layers;
+	layers.background = GdiDraw::createLayer(hwnd, 0);
+	layers.overlay = GdiDraw::createLayer(hwnd, 1);
+
+	GdiDraw::setRenderScale(hwnd, renderScale);
+	GdiDraw::setTargetFrameTime(hwnd, targetFrameMs);
+
+	FramePacer pacer;
+	int frame = 0;
+	while (Window::exists(h))
+	{
+		co_await pacer.nextFrame();
+		co_await beginDrawingAsync(hwnd);
+		++frame;
 
-	std::thread(doDrawing, h).detach();
+		if (frame > WarmupFrames)
+		{
+			// Once warmed up, drawing must stay off the heap
+			NoAllocationScope noAllocations;
+			drawFrame(hwnd, layers, frame);
+			GdiDraw::endDrawing(hwnd);
+		}
+		else
+		{
+			drawFrame(hwnd, layers, frame);
+			GdiDraw::endDrawing(hwnd);
+		}
+	}
+}
 
+static RenderTask repaintLoop(WindowHandle h)
+{
+	FramePacer pacer;
+	pacer.intervalMs = 33;
 	while (Window::exists(h))
 	{
-		sleep(33);
-		printf(".");
+		co_await pacer.nextFrame();
 		Window::repaint(h);
 	}
+}
+
+#pragma pack(push, 2)
+struct BitmapHeader
+{
+	// BITMAPFILEHEADER
+	uint16_t type;
+	uint32_t fileSize;
+	uint32_t reserved;
+	uint32_t pixelOffset;
+
+	// BITMAPINFOHEADER
+	uint32_t infoSize;
+	int32_t w;
+	int32_t h;
+	uint16_t planes;
+	uint16_t bitCount;
+	uint32_t compression;
+	uint32_t imageSize;
+	int32_t xPixelsPerMeter;
+	int32_t yPixelsPerMeter;
+	uint32_t colorsUsed;
+	uint32_t colorsImportant;
+};
+#pragma pack(pop)
+
+// The presented buffer is already bottom-up BGRA, which is what a 32-bit
+// BMP stores, so the pixels are written as they are
+static bool writeBitmap(const char *path, const CapturedFrame &frame)
+{
+	FILE *file = nullptr;
+	if (fopen_s(&file, path, "wb") != 0 || !file)
+		return false;
+
+	uint32_t pixelBytes = uint32_t(frame.w) * uint32_t(frame.h) * 4;
+
+	BitmapHeader header = {};
+	header.type = 0x4d42; // "BM"
+	header.pixelOffset = sizeof(BitmapHeader);
+	header.fileSize = header.pixelOffset + pixelBytes;
+	header.infoSize = 40;
+	header.w = frame.w;
+	header.h = frame.h;
+	header.planes = 1;
+	header.bitCount = 32;
+	header.imageSize = pixelBytes;
+
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(frame.pixels, 1, pixelBytes, file) == pixelBytes;
+	fclose(file);
+	return written;
+}
+
+// Opens the demo window, saves the first frames it presents and closes it
+static int captureScreenshot(const WindowHandle &h, const char *path)
+{
+	void *hwnd = Window::waitForOpen(h);
+	if (!hwnd)
+		return 1;
+
+	// Skip the frames presented before anything was drawn
+	sleep(100);
+
+	CaptureHandle capture = GdiDraw::captureAsync(hwnd);
+	const CapturedFrame *frame = capture.wait(5000);
+	bool written = frame && writeBitmap(path, *frame);
+	printf(written ? "Saved %s\n" : "Could not capture %s\n", path);
+
+	Window::close(h);
+	Window::waitForClose(h);
+	return written ? 0 : 1;
+}
+
+static int inspectRecording(const char *path)
+{
+	FrameReader reader;
+	if (!reader.open(path))
+	{
+		printf("Could not open recording '%s'\n", path);
+		return 1;
+	}
+
+	RecordedFrame frame;
+	uint32_t expectedFrame = 0;
+	uint64_t dropped = 0;
+	uint64_t frames = 0;
+	while (reader.next(frame))
+	{
+		dropped += frame.frameNumber - expectedFrame;
+		expectedFrame = frame.frameNumber + 1;
+		++frames;
+
+		uint64_t checksum = 0;
+		for (int i = 0, end = frame.w * frame.h; i < end; ++i)
+			checksum = checksum * 31 + frame.pixels[i];
 
+		printf("frame %u  t=%.3fs  %dx%d  %s%u bytes  checksum %016" PRIx64 "\n",
+			frame.frameNumber, frame.timeUs / 1000000.0, frame.w, frame.h,
+			frame.keyFrame ? "key " : "", frame.encodedBytes, checksum);
+	}
+
+	printf("%" PRIu64 " frames, %" PRIu64 " dropped\n", frames, dropped);
 	return 0;
 }
+
+static int verifyKernels()
+{
+	printf("Selected kernels: %s\n", GdiKernels::getName(GdiKernels::selectedIsa()));
+
+	int failures = 0;
+	for (int i = 0; i < int(KernelIsa::Count); ++i)
+	{
+		KernelIsa isa = KernelIsa(i);
+		if (!GdiKernels::isSupported(isa))
+		{
+			printf("%-8s not supported\n", GdiKernels::getName(isa));
+			continue;
+		}
+
+		KernelVerifyResult result = GdiKernels::verify(isa);
+		printf("%-8s %d checks, %d failures%s%s\n", GdiKernels::getName(isa), result.checks, result.failures,
+			result.firstFailure ? ", first in " : "", result.firstFailure ? result.firstFailure : "");
+		failures += result.failures;
+	}
+
+	return failures ? 1 : 0;
+}
+
+static void printPercentiles(const char *name, std::vector<double> &times)
+{
+	std::sort(times.begin(), times.end());
+	auto at = [&](double p) { return times[size_t(p * (times.size() - 1))]; };
+	printf("%-6s p50 %8.3f ms  p90 %8.3f ms  p99 %8.3f ms  max %8.3f ms\n",
+		name, at(0.5), at(0.9), at(0.99), times.back());
+}
+
+// Opens and closes windows from many threads at once. Every thread cycles
+// its own window, so the runs also contend on the shared window maps.
+static int benchLifecycle(int threadCount, int iterations)
+{
+	typedef std::chrono::high_resolution_clock Clock;
+
+	std::vector<std::vector<double>> openTimes(threadCount);
+	std::vector<std::vector<double>> closeTimes(threadCount);
+	std::vector<std::thread> threads;
+
+	Clock::time_point start = Clock::now();
+	for (int t = 0; t < threadCount; ++t)
+	{
+		threads.emplace_back([&, t]()
+		{
+			WindowHandle h("Lifecycle", uint32_t(t + 1));
+			for (int i = 0; i < iterations; ++i)
+			{
+				Clock::time_point begin = Clock::now();
+				Window::open(h);
+				bool opened = Window::waitForOpen(h) != nullptr;
+				Clock::time_point open = Clock::now();
+				Window::close(h);
+				Window::waitForClose(h);
+				Clock::time_point end = Clock::now();
+
+				if (opened)
+				{
+					openTimes[t].push_back(std::chrono::duration<double, std::milli>(open - begin).count());
+					closeTimes[t].push_back(std::chrono::duration<double, std::milli>(end - open).count());
+				}
+			}
+		});
+	}
+
+	for (std::thread &thread : threads)
+		thread.join();
+
+	double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+	std::vector<double> opens, closes;
+	for (int t = 0; t < threadCount; ++t)
+	{
+		opens.insert(opens.end(), openTimes[t].begin(), openTimes[t].end());
+		closes.insert(closes.end(), closeTimes[t].begin(), closeTimes[t].end());
+	}
+
+	int expected = threadCount * iterations;
+	printf("%d threads, %d of %d cycles, %.1f cycles/s\n", threadCount, int(opens.size()), expected, opens.size() / seconds);
+	if (opens.empty())
+		return 1;
+
+	printPercentiles("open", opens);
+	printPercentiles("close", closes);
+	return int(opens.size()) == expected ? 0 : 1;
+}
+
+// Mpixels/s of span over rounds passes of a span of count pixels
+template<typename Run>
+static double measureSpans(int rounds, int count, Run run)
+{
+	typedef std::chrono::high_resolution_clock Clock;
+	Clock::time_point start = Clock::now();
+	for (int i = 0; i < rounds; ++i)
+		run();
+	double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	return double(rounds) * count / seconds / 1e6;
+}
+
+// Every pixel pipeline combination as its specialized instantiation, through
+// the per-pixel switches of runGeneric, and as PixelPipeline::get picks it
+static int benchPipelines(int rounds)
+{
+	const int Width = 1024;
+
+	std::mt19937 random(1234);
+	std::vector<uint32_t> texture(Width);
+	std::vector<uint32_t> initial(Width);
+	for (int i = 0; i < Width; ++i)
+	{
+		texture[i] = uint32_t(random());
+		initial[i] = uint32_t(random());
+	}
+
+	GradientLut lut;
+	for (int i = 0; i < GradientLut::Size; ++i)
+		lut.colors[i] = uint32_t(random());
+
+	SpanSource source;
+	source.color = 0x80c04020;
+	source.pixels = texture.data();
+	source.opacity = 200;
+	source.lut = lut.colors;
+	source.t0 = -20;
+	source.dt = 0.3f;
+	source.dx0 = -300;
+	source.dy2 = 900;
+	source.scale = 0.5f;
+
+	printf("Selected kernels: %s, %d spans of %d pixels, Mpixels/s\n", GdiKernels::getName(GdiKernels::selectedIsa()), rounds, Width);
+	printf("%-6s %-8s %-15s %12s %12s %8s %12s\n", "format", "blend", "source", "specialized", "generic", "speedup", "selected");
+
+	int mismatches = 0;
+	std::vector<uint32_t> dst(Width);
+	std::vector<uint32_t> check(Width);
+	for (int f = 0; f < int(PixelFormat::Count); ++f)
+	{
+		for (int b = 0; b < int(BlendMode::Count); ++b)
+		{
+			for (int c = 0; c < int(ColorSource::Count); ++c)
+			{
+				PixelFormat format = PixelFormat(f);
+				BlendMode blend = BlendMode(b);
+				ColorSource colorSource = ColorSource(c);
+				SpanFunction specialized = PixelPipeline::getSpecialized(format, blend, colorSource);
+				SpanFunction selected = PixelPipeline::get(format, blend, colorSource);
+
+				dst = initial;
+				check = initial;
+				specialized(dst.data(), Width, source);
+				PixelPipeline::runGeneric(format, blend, colorSource, check.data(), Width, source);
+				bool matches = dst == check;
+				mismatches += matches ? 0 : 1;
+
+				double specializedRate = measureSpans(rounds, Width, [&] { specialized(dst.data(), Width, source); });
+				double genericRate = measureSpans(rounds, Width, [&] { PixelPipeline::runGeneric(format, blend, colorSource, dst.data(), Width, source); });
+				double selectedRate = measureSpans(rounds, Width, [&] { selected(dst.data(), Width, source); });
+
+				printf("%-6s %-8s %-15s %12.0f %12.0f %7.2fx %12.0f%s\n", PixelPipeline::getName(format), PixelPipeline::getName(blend), PixelPipeline::getName(colorSource),
+					specializedRate, genericRate, specializedRate / genericRate, selectedRate, matches ? "" : "  MISMATCH");
+			}
+		}
+	}
+
+	return mismatches ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *recordPath = nullptr;
+	const char *screenshotPath = nullptr;
+	const char *tracePath = nullptr;
+	int windowCount = 1;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--inspect") == 0 && i + 1 < argc)
+			return inspectRecording(argv[i + 1]);
+		else if (strcmp(argv[i], "--verify-kernels") == 0)
+			return verifyKernels();
+		else if (strcmp(argv[i], "--bench-lifecycle") == 0)
+		{
+			int threadCount = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+			int iterations = i + 2 < argc ? atoi(argv[i + 2]) : 0;
+			return benchLifecycle(threadCount > 0 ? threadCount : 8, iterations > 0 ? iterations : 50);
+		}
+		else if (strcmp(argv[i], "--bench-pipelines") == 0)
+		{
+			int rounds = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+			return benchPipelines(rounds > 0 ? rounds : 20000);
+		}
+		else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+			recordPath = argv[++i];
+		else if (strcmp(argv[i], "--screenshot") == 0 && i + 1 < argc)
+			screenshotPath = argv[++i];
+		else if (strcmp(argv[i], "--share") == 0 && i + 1 < argc)
+			sharedMemoryName = argv[++i];
+		else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc)
+			renderScale = float(atof(argv[++i]));
+		else if (strcmp(argv[i], "--target-ms") == 0 && i + 1 < argc)
+			targetFrameMs = float(atof(argv[++i]));
+		else if (strcmp(argv[i], "--windows") == 0 && i + 1 < argc)
+			windowCount = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+			tracePath = argv[++i];
+		else if (strcmp(argv[i], "--budget-mb") == 0 && i + 1 < argc)
+			GdiDraw::setFramebufferBudget(uint64_t(atof(argv[++i]) * 1024 * 1024));
+	}
+
+	Trace::setThreadName("Main");
+	if (tracePath && !Trace::isEnabled())
+		printf("Built without GDIWINDOW_TRACE, %s will be empty\n", tracePath);
+
+	// Every window animates on the shared render executor, however many
+	// there are
+	std::vector<WindowHandle> handles;
+	for (int i = 0; i < (windowCount > 1 ? windowCount : 1); ++i)
+	{
+		WindowHandle h("asdf", uint32_t(i));
+		Window::registerStartedDelegate(h, &initGdiDraw);
+		Window::registerStoppingDelegate(h, &deinitGdiDraw);
+		Window::registerPaintDelegate(h, &paintGdiDraw);
+		Window::registerMoveDelegate(h, &moved);
+		Window::registerResizeDelegate(h, &resized);
+		Window::registerMessageDelegate(h, &message);
+		Window::registerVisibilityDelegate(h, &visibilityChanged);
+		Window::open(h);
+		handles.push_back(h);
+	}
+
+	WindowHandle h = handles.front();
+	if (recordPath)
+	{
+		if (void *hwnd = Window::waitForOpen(h))
+			FrameRecorder::start(hwnd, recordPath);
+	}
+
+	for (const WindowHandle &handle : handles)
+	{
+		RenderExecutor::spawn(renderLoop(handle));
+		RenderExecutor::spawn(repaintLoop(handle));
+	}
+
+	int result = 0;
+	if (screenshotPath)
+	{
+		result = captureScreenshot(h, screenshotPath);
+	}
+	else
+	{
+		for (const WindowHandle &handle : handles)
+			Window::waitForClose(handle);
+	}
+
+	if (tracePath)
+		printf(Trace::writeChromeTrace(tracePath) ? "Saved %s\n" : "Could not save %s\n", tracePath);
+
+	return result;
+}
@@ -0,0 +1,161 @@
+#include "PixelPipeline.h"
+
+namespace GdiWindow
+{
+
+template<typename Format, typename Blend>
+static SpanFunction selectSource(ColorSource source)
+{
+	switch (source)
+	{
+	case ColorSource::Solid: return &runSpan<Format, Blend, SolidSource>;
+	case ColorSource::Texture: return &runSpan<Format, Blend, TextureSource>;
+	case ColorSource::ScaledTexture: return &runSpan<Format, Blend, ScaledTextureSource>;
+	case ColorSource::LinearGradient: return &runSpan<Format, Blend, LinearGradientSource>;
+	case ColorSource::RadialGradient: return &runSpan<Format, Blend, RadialGradientSource>;
+	default: return nullptr;
+	}
+}
+
+template<typename Format>
+static SpanFunction selectBlend(BlendMode blend, ColorSource source)
+{
+	switch (blend)
+	{
+	case BlendMode::Replace: return selectSource<Format, ReplaceBlend>(source);
+	case BlendMode::Over: return selectSource<Format, OverBlend>(source);
+	case BlendMode::Add: return selectSource<Format, AddBlend>(source);
+	default: return nullptr;
+	}
+}
+
+SpanFunction PixelPipeline::getSpecialized(PixelFormat format, BlendMode blend, ColorSource source)
+{
+	switch (format)
+	{
+	case PixelFormat::Bgra: return selectBlend<BgraFormat>(blend, source);
+	case PixelFormat::Rgba: return selectBlend<RgbaFormat>(blend, source);
+	default: return nullptr;
+	}
+}
+
+// Combinations the kernel table has SIMD variants of
+
+static void fillSpan(uint32_t *dst, int count, const SpanSource &s)
+{
+	GdiKernels::get().fill(dst, count, s.color);
+}
+
+static void blendColorSpan(uint32_t *dst, int count, const SpanSource &s)
+{
+	GdiKernels::get().blendColor(dst, count, s.color);
+}
+
+static void blitSpan(uint32_t *dst, int count, const SpanSource &s)
+{
+	GdiKernels::get().blit(dst, s.pixels, count);
+}
+
+static void blendSpan(uint32_t *dst, int count, const SpanSource &s)
+{
+	GdiKernels::get().blend(dst, s.pixels, count);
+}
+
+static void blendOpacitySpan(uint32_t *dst, int count, const SpanSource &s)
+{
+	GdiKernels::get().blendOpacity(dst, s.pixels, count, s.opacity);
+}
+
+static void swapRedBlueSpan(uint32_t *dst, int count, const SpanSource &s)
+{
+	GdiKernels::get().swapRedBlue(dst, s.pixels, count);
+}
+
+static void linearGradientSpan(uint32_t *dst, int count, const SpanSource &s)
+{
+	GdiKernels::get().linearGradient(dst, count, s.t0, s.dt, s.lut);
+}
+
+static void radialGradientSpan(uint32_t *dst, int count, const SpanSource &s)
+{
+	GdiKernels::get().radialGradient(dst, count, s.dx0, s.dy2, s.scale, s.lut);
+}
+
+SpanFunction PixelPipeline::get(PixelFormat format, BlendMode blend, ColorSource source)
+{
+	if (format == PixelFormat::Bgra && blend == BlendMode::Replace)
+	{
+		switch (source)
+		{
+		case ColorSource::Solid: return &fillSpan;
+		case ColorSource::Texture: return &blitSpan;
+		case ColorSource::LinearGradient: return &linearGradientSpan;
+		case ColorSource::RadialGradient: return &radialGradientSpan;
+		default: break;
+		}
+	}
+	else if (format == PixelFormat::Bgra && blend == BlendMode::Over)
+	{
+		switch (source)
+		{
+		case ColorSource::Solid: return &blendColorSpan;
+		case ColorSource::Texture: return &blendSpan;
+		case ColorSource::ScaledTexture: return &blendOpacitySpan;
+		default: break;
+		}
+	}
+	else if (format == PixelFormat::Rgba && blend == BlendMode::Replace && source == ColorSource::Texture)
+	{
+		return &swapRedBlueSpan;
+	}
+
+	return getSpecialized(format, blend, source);
+}
+
+void PixelPipeline::runGeneric(PixelFormat format, BlendMode blend, ColorSource source, uint32_t *dst, int count, const SpanSource &spanSource)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		uint32_t s = 0;
+		bool premultiplied = false;
+		switch (source)
+		{
+		case ColorSource::Solid: s = SolidSource::pixel(spanSource, i); break;
+		case ColorSource::Texture: s = TextureSource::pixel(spanSource, i); premultiplied = true; break;
+		case ColorSource::ScaledTexture: s = ScaledTextureSource::pixel(spanSource, i); premultiplied = true; break;
+		case ColorSource::LinearGradient: s = LinearGradientSource::pixel(spanSource, i); break;
+		case ColorSource::RadialGradient: s = RadialGradientSource::pixel(spanSource, i); break;
+		default: break;
+		}
+
+		uint32_t d = format == PixelFormat::Rgba ? RgbaFormat::load(dst[i]) : BgraFormat::load(dst[i]);
+		switch (blend)
+		{
+		case BlendMode::Over: s = premultiplied ? OverBlend::blend<true>(d, s) : OverBlend::blend<false>(d, s); break;
+		case BlendMode::Add: s = premultiplied ? AddBlend::blend<true>(d, s) : AddBlend::blend<false>(d, s); break;
+		default: break;
+		}
+
+		dst[i] = format == PixelFormat::Rgba ? RgbaFormat::store(s) : BgraFormat::store(s);
+	}
+}
+
+const char *PixelPipeline::getName(PixelFormat format)
+{
+	static const char *names[] = { "bgra", "rgba" };
+	return format < PixelFormat::Count ? names[int(format)] : "?";
+}
+
+const char *PixelPipeline::getName(BlendMode blend)
+{
+	static const char *names[] = { "replace", "over", "add" };
+	return blend < BlendMode::Count ? names[int(blend)] : "?";
+}
+
+const char *PixelPipeline::getName(ColorSource source)
+{
+	static const char *names[] = { "solid", "texture", "scaledTexture", "linearGradient", "radialGradient" };
+	return source < ColorSource::Count ? names[int(source)] : "?";
+}
+
+}
@@ -0,0 +1,241 @@
+#pragma once
+
+#include "GdiKernels.h"
+
+#include <math.h>
+
+namespace GdiWindow
+{
+
+// Span processing composed from a pixel format, a blend mode and a color
+// source. Each combination is its own template instantiation, so the modes
+// are resolved at compile time and the inner loop has no switches. The
+// scalar kernel table is built from these.
+
+enum class PixelFormat
+{
+	Bgra,
+
+	// Channels swapped on load and store, e.g. for captures
+	Rgba,
+	Count
+};
+
+enum class BlendMode
+{
+	Replace,
+
+	// Straight-alpha sources blend like blendColor, premultiplied ones
+	// like blend
+	Over,
+
+	// Premultiplied source added to dst, saturating
+	Add,
+	Count
+};
+
+enum class ColorSource
+{
+	Solid,
+	Texture,
+	ScaledTexture,
+	LinearGradient,
+	RadialGradient,
+	Count
+};
+
+// The inputs of every source. Callers fill in the ones their source uses
+// once per primitive and advance the per-row ones.
+struct SpanSource
+{
+	// Solid, straight alpha
+	uint32_t color = 0;
+
+	// Texture and ScaledTexture, premultiplied, one per dst pixel
+	const uint32_t *pixels = nullptr;
+
+	// ScaledTexture, 0-255
+	uint32_t opacity = 255;
+
+	// Gradients, as in KernelTable::linearGradient and radialGradient
+	const uint32_t *lut = nullptr;
+	float t0 = 0, dt = 0;
+	float dx0 = 0, dy2 = 0, scale = 0;
+};
+
+typedef void (*SpanFunction)(uint32_t *dst, int count, const SpanSource &source);
+
+struct PixelPipeline
+{
+	// The function for a combination, picked once per primitive. Those with
+	// a SIMD kernel in GdiKernels::get() use it, the rest their template
+	// instantiation.
+	static SpanFunction get(PixelFormat format, BlendMode blend, ColorSource source);
+
+	// Always the template instantiation
+	static SpanFunction getSpecialized(PixelFormat format, BlendMode blend, ColorSource source);
+
+	// One loop for every combination that switches on the modes per pixel.
+	// Produces the same bytes as getSpecialized; only kept as a baseline to
+	// measure it against.
+	static void runGeneric(PixelFormat format, BlendMode blend, ColorSource source, uint32_t *dst, int count, const SpanSource &spanSource);
+
+	static const char *getName(PixelFormat format);
+	static const char *getName(BlendMode blend);
+	static const char *getName(ColorSource source);
+};
+
+inline uint32_t swapPixelRedBlue(uint32_t c)
+{
+	return (c & 0xff00ff00) | (c >> 16 & 0xff) | (c & 0xff) << 16;
+}
+
+// The blends work on two channels at a time, B and R or G and A, each in
+// the low byte of a 16-bit lane. Products of two bytes fit a lane.
+static const uint32_t ChannelPairMask = 0x00ff00ff;
+
+// div255 of both lanes
+inline uint32_t div255Pair(uint32_t x)
+{
+	x += 0x00800080;
+	return (x + (x >> 8 & ChannelPairMask)) >> 8 & ChannelPairMask;
+}
+
+// Clamps lanes of up to 510 to 255
+inline uint32_t saturatePair(uint32_t x)
+{
+	return (x | (x >> 8 & 0x00010001) * 0xff) & ChannelPairMask;
+}
+
+inline uint32_t scalePixel(uint32_t c, uint32_t scale)
+{
+	return div255Pair((c & ChannelPairMask) * scale) | div255Pair((c >> 8 & ChannelPairMask) * scale) << 8;
+}
+
+// Formats convert between memory and BGRA
+
+struct BgraFormat
+{
+	static uint32_t load(uint32_t c) { return c; }
+	static uint32_t store(uint32_t c) { return c; }
+};
+
+struct RgbaFormat
+{
+	static uint32_t load(uint32_t c) { return swapPixelRedBlue(c); }
+	static uint32_t store(uint32_t c) { return swapPixelRedBlue(c); }
+};
+
+// Sources give the BGRA color of the i-th pixel of the span
+
+// Constant sources are read once per span
+struct SolidSource
+{
+	static const bool Premultiplied = false;
+	static const bool Constant = true;
+	static uint32_t pixel(const SpanSource &s, int i) { return s.color; }
+};
+
+struct TextureSource
+{
+	static const bool Premultiplied = true;
+	static const bool Constant = false;
+	static uint32_t pixel(const SpanSource &s, int i) { return s.pixels[i]; }
+};
+
+struct ScaledTextureSource
+{
+	static const bool Premultiplied = true;
+	static const bool Constant = false;
+	static uint32_t pixel(const SpanSource &s, int i) { return scalePixel(s.pixels[i], s.opacity); }
+};
+
+struct LinearGradientSource
+{
+	static const bool Premultiplied = false;
+	static const bool Constant = false;
+	static uint32_t pixel(const SpanSource &s, int i)
+	{
+		return s.lut[int(clampLutPosition(s.t0 + s.dt * float(i)) + 0.5f)];
+	}
+};
+
+struct RadialGradientSource
+{
+	static const bool Premultiplied = false;
+	static const bool Constant = false;
+	static uint32_t pixel(const SpanSource &s, int i)
+	{
+		float x = s.dx0 + float(i);
+		return s.lut[int(clampLutPosition(sqrtf(x * x + s.dy2) * s.scale) + 0.5f)];
+	}
+};
+
+// Blends combine a source color with the BGRA color under it
+
+struct ReplaceBlend
+{
+	static const bool ReadsDst = false;
+
+	template<bool Premultiplied>
+	static uint32_t blend(uint32_t d, uint32_t s) { return s; }
+};
+
+struct OverBlend
+{
+	static const bool ReadsDst = true;
+
+	template<bool Premultiplied>
+	static uint32_t blend(uint32_t d, uint32_t s)
+	{
+		uint32_t a = s >> 24;
+		uint32_t inv = 255 - a;
+		uint32_t dRb = d & ChannelPairMask;
+		uint32_t dGa = d >> 8 & ChannelPairMask;
+		if constexpr (Premultiplied)
+		{
+			uint32_t rb = (s & ChannelPairMask) + div255Pair(dRb * inv);
+			uint32_t ga = (s >> 8 & ChannelPairMask) + div255Pair(dGa * inv);
+			return saturatePair(rb) | saturatePair(ga) << 8;
+		}
+		else
+		{
+			// Alpha blends towards opaque
+			s |= 0xff000000;
+			uint32_t rb = div255Pair((s & ChannelPairMask) * a + dRb * inv);
+			uint32_t ga = div255Pair((s >> 8 & ChannelPairMask) * a + dGa * inv);
+			return rb | ga << 8;
+		}
+	}
+};
+
+struct AddBlend
+{
+	static const bool ReadsDst = true;
+
+	template<bool Premultiplied>
+	static uint32_t blend(uint32_t d, uint32_t s)
+	{
+		if constexpr (!Premultiplied)
+			s = (scalePixel(s, s >> 24) & 0x00ffffff) | (s & 0xff000000);
+
+		uint32_t rb = (s & ChannelPairMask) + (d & ChannelPairMask);
+		uint32_t ga = (s >> 8 & ChannelPairMask) + (d >> 8 & ChannelPairMask);
+		return saturatePair(rb) | saturatePair(ga) << 8;
+	}
+};
+
+template<typename Format, typename Blend, typename Source>
+void runSpan(uint32_t *dst, int count, const SpanSource &source)
+{
+	uint32_t constant = Source::Constant ? Source::pixel(source, 0) : 0;
+	for (int i = 0; i < count; ++i)
+	{
+		uint32_t s = Source::Constant ? constant : Source::pixel(source, i);
+		if constexpr (Blend::ReadsDst)
+			s = Blend::template blend<Source::Premultiplied>(Format::load(dst[i]), s);
+		dst[i] = Format::store(s);
+	}
+}
+
+}
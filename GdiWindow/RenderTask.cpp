@@ -0,0 +1,177 @@
+#include "RenderTask.h"
+
+#include "GdiDrawing.h"
+#include "Guard.h"
+#include "Trace.h"
+#include "WorkerThreads.h"
+
+#include <condition_variable>
+#include <deque>
+#include <queue>
+#include <vector>
+
+namespace GdiWindow
+{
+
+static const int MaxExecutorThreads = 4;
+
+struct ReadyQueue
+{
+	bool started = false;
+	int threadCount = 0;
+	std::deque<std::coroutine_handle<>> queue;
+	std::condition_variable changed;
+};
+
+struct Timer
+{
+	RenderExecutor::Clock::time_point time;
+	std::coroutine_handle<> handle;
+
+	// Earliest on top of the priority queue
+	bool operator<(const Timer &o) const { return time > o.time; }
+};
+
+struct TimerQueue
+{
+	bool started = false;
+	std::priority_queue<Timer> timers;
+	std::condition_variable changed;
+};
+
+static Guard<ReadyQueue> &getReadyQueue()
+{
+	return getWorkerState<ReadyQueue>();
+}
+
+static Guard<TimerQueue> &getTimerQueue()
+{
+	return getWorkerState<TimerQueue>();
+}
+
+static void workerThread()
+{
+	Trace::setThreadName("Render worker");
+
+	Guard<ReadyQueue> &queue = getReadyQueue();
+	std::unique_lock<std::mutex> lock(queue.m);
+	while (true)
+	{
+		queue.t.changed.wait(lock, [&queue] { return !queue.t.queue.empty(); });
+
+		std::coroutine_handle<> handle = queue.t.queue.front();
+		queue.t.queue.pop_front();
+
+		lock.unlock();
+		{
+			TRACE_ZONE("Render task");
+			handle.resume();
+		}
+		lock.lock();
+	}
+}
+
+static void timerThread()
+{
+	Trace::setThreadName("Render timers");
+
+	Guard<TimerQueue> &queue = getTimerQueue();
+	std::unique_lock<std::mutex> lock(queue.m);
+	while (true)
+	{
+		if (queue.t.timers.empty())
+		{
+			queue.t.changed.wait(lock);
+			continue;
+		}
+
+		Timer timer = queue.t.timers.top();
+		if (RenderExecutor::Clock::now() < timer.time)
+		{
+			queue.t.changed.wait_until(lock, timer.time);
+			continue;
+		}
+
+		queue.t.timers.pop();
+		lock.unlock();
+		RenderExecutor::post(timer.handle);
+		lock.lock();
+	}
+}
+
+void RenderExecutor::spawn(RenderTask task)
+{
+	std::coroutine_handle<> handle = task.handle;
+
+	// The coroutine frees itself from now on
+	task.handle = nullptr;
+	post(handle);
+}
+
+void RenderExecutor::post(std::coroutine_handle<> handle)
+{
+	Ref<ReadyQueue> queue = getReadyQueue();
+	queue->queue.push_back(handle);
+	queue->changed.notify_one();
+
+	if (!queue->started)
+	{
+		queue->threadCount = WorkerThreads::getPoolSize(1, MaxExecutorThreads);
+		WorkerThreads::start(queue->started, queue->threadCount, &workerThread);
+	}
+}
+
+void RenderExecutor::postAt(Clock::time_point time, std::coroutine_handle<> handle)
+{
+	Ref<TimerQueue> queue = getTimerQueue();
+
+	// Only an earlier first timer changes how long the timer thread sleeps
+	bool first = queue->timers.empty() || time < queue->timers.top().time;
+	queue->timers.push(Timer{ time, handle });
+	if (first)
+		queue->changed.notify_one();
+
+	WorkerThreads::start(queue->started, 1, &timerThread);
+}
+
+int RenderExecutor::getThreadCount()
+{
+	Ref<ReadyQueue> queue = getReadyQueue();
+	return queue->threadCount;
+}
+
+DelayAwaiter FramePacer::nextFrame()
+{
+	RenderExecutor::Clock::time_point now = RenderExecutor::Clock::now();
+	RenderExecutor::Clock::duration interval = std::chrono::microseconds(int64_t(intervalMs * 1000));
+
+	next += interval;
+	if (next < now)
+		next = now;
+
+	return DelayAwaiter{ next };
+}
+
+static void resumeOnExecutor(void *address)
+{
+	RenderExecutor::post(std::coroutine_handle<>::from_address(address));
+}
+
+bool WindowOpenAwaiter::await_suspend(std::coroutine_handle<> handle) const
+{
+	return !Window::tryWaitForOpen(windowHandle, &resumeOnExecutor, handle.address());
+}
+
+void *WindowOpenAwaiter::await_resume() const
+{
+	return Window::getHwnd(windowHandle);
+}
+
+bool DrawingAwaiter::await_suspend(std::coroutine_handle<> handle) const
+{
+	// Resumes on the executor rather than on the window's thread, which
+	// has to get back to its messages
+	return !GdiDraw::tryBeginDrawing(hwnd, &resumeOnExecutor, handle.address());
+}
+
+}
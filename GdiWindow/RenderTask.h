@@ -0,0 +1,117 @@
+#pragma once
+
+#include "Window.h"
+
+#include <chrono>
+#include <coroutine>
+#include <exception>
+
+namespace GdiWindow
+{
+
+// A render loop written as a coroutine. It starts suspended, runs on the
+// RenderExecutor once spawned and frees itself when it returns.
+struct RenderTask
+{
+	struct promise_type
+	{
+		RenderTask get_return_object() { return RenderTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+
+	explicit RenderTask(std::coroutine_handle<promise_type> handle)
+		: handle(handle)
+	{
+	}
+
+	RenderTask(const RenderTask &o) = delete;
+
+	RenderTask(RenderTask &&o)
+		: handle(o.handle)
+	{
+		o.handle = nullptr;
+	}
+
+	~RenderTask()
+	{
+		if (handle)
+			handle.destroy();
+	}
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+// A few worker threads shared by every render task, and a timer thread that
+// hands them tasks whose delay has passed. Started on first use and never
+// stopped. Tasks must not block; everything that waits should be co_awaited.
+struct RenderExecutor
+{
+	typedef std::chrono::steady_clock Clock;
+
+	static void spawn(RenderTask task);
+	static void post(std::coroutine_handle<> handle);
+	static void postAt(Clock::time_point time, std::coroutine_handle<> handle);
+
+	static int getThreadCount();
+};
+
+struct DelayAwaiter
+{
+	RenderExecutor::Clock::time_point time;
+
+	bool await_ready() const { return RenderExecutor::Clock::now() >= time; }
+	void await_suspend(std::coroutine_handle<> handle) const { RenderExecutor::postAt(time, handle); }
+	void await_resume() const {}
+};
+
+inline DelayAwaiter delay(float ms)
+{
+	return DelayAwaiter{ RenderExecutor::Clock::now() + std::chrono::microseconds(int64_t(ms * 1000)) };
+}
+
+// Frame slots at a fixed interval. A task that falls behind skips the slots
+// it missed instead of running them back to back.
+struct FramePacer
+{
+	float intervalMs = 1000.0f / 60.0f;
+	RenderExecutor::Clock::time_point next;
+
+	DelayAwaiter nextFrame();
+};
+
+// Waits for a window to be created, suspending instead of blocking like
+// Window::waitForOpen. Gives its hwnd, or nullptr if it is not open.
+struct WindowOpenAwaiter
+{
+	WindowHandle windowHandle;
+
+	bool await_ready() const { return false; }
+	bool await_suspend(std::coroutine_handle<> handle) const;
+	void *await_resume() const;
+};
+
+inline WindowOpenAwaiter waitForOpenAsync(const WindowHandle &windowHandle)
+{
+	return WindowOpenAwaiter{ windowHandle };
+}
+
+// Starts a drawing session, suspending instead of blocking while paint has
+// the buffer. Nothing may be awaited before the matching endDrawing.
+struct DrawingAwaiter
+{
+	void *hwnd = nullptr;
+
+	bool await_ready() const { return false; }
+	bool await_suspend(std::coroutine_handle<> handle) const;
+	void await_resume() const {}
+};
+
+inline DrawingAwaiter beginDrawingAsync(void *hwnd)
+{
+	return DrawingAwaiter{ hwnd };
+}
+
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <inttypes.h>
+
+// Layout of a framebuffer exported with GdiDraw::setSharedMemoryName. This
+// header has no dependencies on the rest of the library so other processes
+// can include it on its own.
+//
+// The named mapping starts with a SharedFrameHeader, followed at pixelOffset
+// by the window's 32-bpp BGRA DIB. Rows are bottom-up, stride bytes apart.
+// The header and the pixels are guarded by a seqlock: sequence is odd while
+// the window is drawing and even once a frame is complete.
+//
+// A hidden window closes its view of the mapping. Readers that keep their
+// own view open see the last complete frame until it is shown again.
+
+namespace GdiWindow
+{
+
+struct SharedFrameHeader
+{
+	static const uint32_t Magic = 0x46534447; // "GDSF"
+
+	uint32_t magic;
+	uint32_t pixelOffset;
+	uint64_t mappingSize;
+
+	std::atomic<uint32_t> sequence;
+	uint32_t frameNumber;
+
+	int32_t w;
+	int32_t h;
+	int32_t stride;
+
+	int32_t dirtyX;
+	int32_t dirtyY;
+	int32_t dirtyW;
+	int32_t dirtyH;
+};
+
+inline const unsigned char *sharedFramePixels(const SharedFrameHeader *header)
+{
+	return (const unsigned char *)header + header->pixelOffset;
+}
+
+// Returns the sequence to pass to sharedFrameReadValidate, or an odd value if
+// a frame is being drawn right now and the caller should try again.
+inline uint32_t sharedFrameReadBegin(const SharedFrameHeader *header)
+{
+	return header->sequence.load(std::memory_order_acquire);
+}
+
+// True if nothing was written between sharedFrameReadBegin and now, meaning
+// everything read in between belongs to one complete frame.
+inline bool sharedFrameReadValidate(const SharedFrameHeader *header, uint32_t sequence)
+{
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return (sequence & 1) == 0 && header->sequence.load(std::memory_order_relaxed) == sequence;
+}
+
+}
@@ -0,0 +1,274 @@
+#include "Trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+namespace GdiWindow
+{
+
+bool Trace::isEnabled()
+{
+#ifdef GDIWINDOW_TRACE
+	return true;
+#else
+	return false;
+#endif
+}
+
+#ifdef GDIWINDOW_TRACE
+
+typedef std::chrono::steady_clock TraceClock;
+
+// Ends have no name
+struct TraceEvent
+{
+	std::atomic<int64_t> time;
+	std::atomic<const char *> name;
+};
+
+// Written only by its thread. count is published after each event so the
+// exporter can read behind the writer. A reused ring keeps counting; the
+// events of its new thread start at first.
+struct TraceRing
+{
+	static const uint32_t Capacity = 1 << 16;
+
+	// Guarded by TraceRings::m
+	uint32_t threadId = 0;
+	char threadName[64] = {};
+	uint64_t first = 0;
+
+	std::atomic<uint64_t> count{ 0 };
+	TraceEvent events[Capacity];
+};
+
+// Not the Guard.h helpers, since those record lock waits into the rings
+struct TraceRings
+{
+	std::mutex m;
+	std::vector<TraceRing *> rings;
+
+	// Rings of threads that have exited, still saved until they are reused
+	std::vector<TraceRing *> freeRings;
+
+	uint32_t nextThreadId = 1;
+	TraceClock::time_point start = TraceClock::now();
+};
+
+// Never destroyed, so rings of threads that have exited can still be saved
+static TraceRings &getTraceRings()
+{
+	static TraceRings *rings = new TraceRings;
+	return *rings;
+}
+
+// Hands the ring back when its thread exits. Windows each run a thread, so
+// without reuse every window opened would keep a ring for good.
+struct ThreadRingOwner
+{
+	~ThreadRingOwner()
+	{
+		if (!ring)
+			return;
+
+		TraceRings &rings = getTraceRings();
+		std::lock_guard<std::mutex> lock(rings.m);
+		rings.freeRings.push_back(ring);
+		ring = nullptr;
+	}
+
+	TraceRing *ring = nullptr;
+};
+
+static TraceRing &getThreadRing()
+{
+	static thread_local ThreadRingOwner owner;
+	if (!owner.ring)
+	{
+		TraceRings &rings = getTraceRings();
+		std::lock_guard<std::mutex> lock(rings.m);
+		TraceRing *ring = nullptr;
+		if (!rings.freeRings.empty())
+		{
+			ring = rings.freeRings.back();
+			rings.freeRings.pop_back();
+			ring->threadName[0] = 0;
+			ring->first = ring->count.load(std::memory_order_relaxed);
+		}
+		else
+		{
+			ring = new TraceRing;
+			rings.rings.push_back(ring);
+		}
+
+		ring->threadId = rings.nextThreadId++;
+		owner.ring = ring;
+	}
+
+	return *owner.ring;
+}
+
+static void record(const char *name)
+{
+	TraceRing &ring = getThreadRing();
+	int64_t time = std::chrono::duration_cast<std::chrono::nanoseconds>(TraceClock::now() - getTraceRings().start).count();
+
+	uint64_t count = ring.count.load(std::memory_order_relaxed);
+	TraceEvent &event = ring.events[count % TraceRing::Capacity];
+	event.time.store(time, std::memory_order_relaxed);
+	event.name.store(name, std::memory_order_relaxed);
+	ring.count.store(count + 1, std::memory_order_release);
+}
+
+void Trace::begin(const char *name)
+{
+	record(name ? name : "?");
+}
+
+void Trace::end()
+{
+	record(nullptr);
+}
+
+void Trace::setThreadName(const char *name)
+{
+	TraceRing &ring = getThreadRing();
+	TraceRings &rings = getTraceRings();
+	std::lock_guard<std::mutex> lock(rings.m);
+	strncpy_s(ring.threadName, name, _TRUNCATE);
+}
+
+static void writeJsonString(FILE *file, const char *s)
+{
+	fputc('"', file);
+	for (; *s; ++s)
+	{
+		if (*s == '"' || *s == '\\')
+			fputc('\\', file);
+		if ((unsigned char)*s >= 0x20)
+			fputc(*s, file);
+	}
+	fputc('"', file);
+}
+
+struct CopiedEvent
+{
+	int64_t time;
+	const char *name;
+};
+
+// Copies the events from first on that the writer cannot have overwritten
+// while reading them
+static void copyRing(const TraceRing &ring, uint64_t first, std::vector<CopiedEvent> &events)
+{
+	events.clear();
+
+	uint64_t end = ring.count.load(std::memory_order_acquire);
+	uint64_t begin = end > TraceRing::Capacity ? end - TraceRing::Capacity : 0;
+	begin = begin > first ? begin : first;
+	for (uint64_t i = begin; i < end; ++i)
+	{
+		const TraceEvent &event = ring.events[i % TraceRing::Capacity];
+		events.push_back(CopiedEvent{ event.time.load(std::memory_order_relaxed), event.name.load(std::memory_order_relaxed) });
+	}
+
+	// The writer may also be in the middle of the slot after the last one
+	// it published
+	uint64_t latest = ring.count.load(std::memory_order_acquire) + 1;
+	uint64_t firstValid = latest > TraceRing::Capacity ? latest - TraceRing::Capacity : 0;
+	uint64_t overwritten = firstValid > begin ? firstValid - begin : 0;
+	events.erase(events.begin(), events.begin() + size_t(overwritten < events.size() ? overwritten : events.size()));
+}
+
+bool Trace::writeChromeTrace(const char *path)
+{
+	FILE *file = nullptr;
+	if (fopen_s(&file, path, "wb") != 0 || !file)
+		return false;
+
+	TraceRings &rings = getTraceRings();
+	std::vector<TraceRing *> ringList;
+	{
+		std::lock_guard<std::mutex> lock(rings.m);
+		ringList = rings.rings;
+	}
+
+	fprintf(file, "{\"traceEvents\":[\n");
+	bool first = true;
+	std::vector<CopiedEvent> events;
+	for (TraceRing *ring : ringList)
+	{
+		char threadName[sizeof(ring->threadName)];
+		uint32_t threadId = 0;
+		uint64_t firstEvent = 0;
+		{
+			std::lock_guard<std::mutex> lock(rings.m);
+			memcpy(threadName, ring->threadName, sizeof(threadName));
+			threadId = ring->threadId;
+			firstEvent = ring->first;
+		}
+
+		if (threadName[0])
+		{
+			fprintf(file, "%s{\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"name\":\"thread_name\",\"args\":{\"name\":", first ? "" : ",\n", threadId);
+			writeJsonString(file, threadName);
+			fprintf(file, "}}");
+			first = false;
+		}
+
+		copyRing(*ring, firstEvent, events);
+
+		// Ends whose begin has already been dropped would confuse the viewer
+		int depth = 0;
+		for (const CopiedEvent &event : events)
+		{
+			if (!event.name && depth == 0)
+				continue;
+
+			depth += event.name ? 1 : -1;
+			fprintf(file, "%s{\"ph\":\"%s\",\"pid\":1,\"tid\":%u,\"ts\":%.3f", first ? "" : ",\n", event.name ? "B" : "E", threadId, double(event.time) / 1000.0);
+			if (event.name)
+			{
+				fprintf(file, ",\"name\":");
+				writeJsonString(file, event.name);
+			}
+			fprintf(file, "}");
+			first = false;
+		}
+	}
+	fprintf(file, "\n]}\n");
+
+	return fclose(file) == 0;
+}
+
+#else
+
+void Trace::begin(const char *name)
+{
+}
+
+void Trace::end()
+{
+}
+
+void Trace::setThreadName(const char *name)
+{
+}
+
+bool Trace::writeChromeTrace(const char *path)
+{
+	FILE *file = nullptr;
+	if (fopen_s(&file, path, "wb") != 0 || !file)
+		return false;
+
+	fprintf(file, "{\"traceEvents\":[]}\n");
+	return fclose(file) == 0;
+}
+
+#endif
+
+}
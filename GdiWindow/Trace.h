@@ -0,0 +1,57 @@
+#pragma once
+
+#include <inttypes.h>
+
+namespace GdiWindow
+{
+
+// A timeline of nested zones, recorded when the project is built with
+// GDIWINDOW_TRACE defined. Without it the zones compile to nothing and
+// writeChromeTrace writes an empty trace.
+//
+// Every thread records into its own ring of the most recent events without
+// taking locks, so older events are dropped rather than blocking anyone.
+// A ring is 1 MiB. Threads that exit hand theirs to the next thread that
+// starts recording, so there are only ever as many rings as the most threads
+// recording at once. Events of an exited thread are saved until then.
+// Zone names are not copied and must outlive the trace, like string
+// literals do.
+struct Trace
+{
+	static bool isEnabled();
+
+	static void begin(const char *name);
+	static void end();
+
+	// Shown for the calling thread in the trace viewer. Copied.
+	static void setThreadName(const char *name);
+
+	// Saves every thread's events as Chrome trace event JSON, which Perfetto
+	// and chrome://tracing open. Threads may keep recording meanwhile.
+	static bool writeChromeTrace(const char *path);
+};
+
+struct TraceZone
+{
+	TraceZone(const TraceZone &) = delete;
+
+	TraceZone(const char *name)
+	{
+		Trace::begin(name);
+	}
+
+	~TraceZone()
+	{
+		Trace::end();
+	}
+};
+
+#ifdef GDIWINDOW_TRACE
+#define GDIWINDOW_TRACE_JOIN2(a, b) a##b
+#define GDIWINDOW_TRACE_JOIN(a, b) GDIWINDOW_TRACE_JOIN2(a, b)
+#define TRACE_ZONE(name) ::GdiWindow::TraceZone GDIWINDOW_TRACE_JOIN(traceZone, __LINE__)(name)
+#else
+#define TRACE_ZONE(name) ((void)0)
+#endif
+
+}
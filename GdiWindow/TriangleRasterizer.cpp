@@ -0,0 +1,207 @@
+#include "TriangleRasterizer.h"
+
+#include <algorithm>
+#include <math.h>
+
+namespace GdiWindow
+{
+
+static const int SubpixelBits = 4;
+static const int SubpixelOne = 1 << SubpixelBits;
+static const int BlockSize = 8;
+
+// Keeps every edge function of a block within 32 bits. Triangles reaching
+// further are clamped, which bends their offscreen parts.
+static const float MaxCoordinate = 16384;
+
+// Color values and steps per pixel are limited so that a block's worth of
+// steps cannot overflow either. Only slivers have steeper colors.
+static const double MaxColor = 16383;
+static const double MaxColorStep = 255;
+
+struct SnappedPoint
+{
+	int64_t x, y;
+};
+
+// E(p) = origin + stepX * x + stepY * y at the center of pixel (x, y),
+// positive inside
+struct EdgeFunction
+{
+	int64_t origin;
+	int64_t stepX;
+	int64_t stepY;
+};
+
+static int64_t snap(float v)
+{
+	v = v < -MaxCoordinate ? -MaxCoordinate : v > MaxCoordinate ? MaxCoordinate : v;
+	return int64_t(floorf(v * SubpixelOne + 0.5f));
+}
+
+// Of the two triangles sharing an edge, which run it in opposite
+// directions, only one owns it. Pixel centers exactly on an edge are only
+// covered by its owner.
+static bool ownsEdge(const SnappedPoint &a, const SnappedPoint &b)
+{
+	int64_t dx = b.x - a.x;
+	int64_t dy = b.y - a.y;
+	return dy > 0 || (dy == 0 && dx < 0);
+}
+
+static EdgeFunction setupEdge(const SnappedPoint &a, const SnappedPoint &b)
+{
+	int64_t dx = b.x - a.x;
+	int64_t dy = b.y - a.y;
+	int64_t half = SubpixelOne / 2;
+
+	EdgeFunction edge;
+	edge.origin = dx * (half - a.y) - dy * (half - a.x) - (ownsEdge(a, b) ? 0 : 1);
+	edge.stepX = -dy * SubpixelOne;
+	edge.stepY = dx * SubpixelOne;
+	return edge;
+}
+
+static double clampDouble(double v, double limit)
+{
+	return v < -limit ? -limit : v > limit ? limit : v;
+}
+
+static int32_t toFixed(double v)
+{
+	return int32_t(floor(v * 65536.0 + 0.5));
+}
+
+IntRect TriangleRasterizer::drawTriangle(const Surface &surface, const IntRect &clip, const RasterVertex vertices[3], const KernelTable &kernels)
+{
+	IntRect none;
+
+	const RasterVertex *v[3] = { &vertices[0], &vertices[1], &vertices[2] };
+	SnappedPoint p[3];
+	for (int i = 0; i < 3; ++i)
+		p[i] = SnappedPoint{ snap(v[i]->x), snap(v[i]->y) };
+
+	int64_t doubleArea = (p[1].x - p[0].x) * (p[2].y - p[0].y) - (p[1].y - p[0].y) * (p[2].x - p[0].x);
+	if (doubleArea == 0)
+		return none;
+
+	// Edge functions are positive inside with this winding
+	if (doubleArea < 0)
+	{
+		std::swap(v[1], v[2]);
+		std::swap(p[1], p[2]);
+	}
+
+	int64_t minX = std::min(p[0].x, std::min(p[1].x, p[2].x));
+	int64_t minY = std::min(p[0].y, std::min(p[1].y, p[2].y));
+	int64_t maxX = std::max(p[0].x, std::max(p[1].x, p[2].x));
+	int64_t maxY = std::max(p[0].y, std::max(p[1].y, p[2].y));
+
+	IntRect bounds;
+	bounds.x = int(minX >> SubpixelBits);
+	bounds.y = int(minY >> SubpixelBits);
+	bounds.w = int(maxX >> SubpixelBits) + 1 - bounds.x;
+	bounds.h = int(maxY >> SubpixelBits) + 1 - bounds.y;
+
+	int x0 = std::max(bounds.x, clip.x);
+	int y0 = std::max(bounds.y, clip.y);
+	int x1 = std::min(bounds.x + bounds.w, clip.x + clip.w);
+	int y1 = std::min(bounds.y + bounds.h, clip.y + clip.h);
+	if (x1 <= x0 || y1 <= y0)
+		return none;
+
+	EdgeFunction edges[3] = { setupEdge(p[1], p[2]), setupEdge(p[2], p[0]), setupEdge(p[0], p[1]) };
+
+	// Color planes: c = base + dx * (x - x0) + dy * (y - y0) in pixels from
+	// the first corner
+	double ex1 = double(p[1].x - p[0].x) / SubpixelOne, ey1 = double(p[1].y - p[0].y) / SubpixelOne;
+	double ex2 = double(p[2].x - p[0].x) / SubpixelOne, ey2 = double(p[2].y - p[0].y) / SubpixelOne;
+	double cross = ex1 * ey2 - ex2 * ey1;
+	double originX = double(p[0].x) / SubpixelOne;
+	double originY = double(p[0].y) / SubpixelOne;
+
+	double base[4], gradX[4], gradY[4];
+	for (int c = 0; c < 4; ++c)
+	{
+		const float RasterVertex::*channel = c == 0 ? &RasterVertex::b : c == 1 ? &RasterVertex::g : c == 2 ? &RasterVertex::r : &RasterVertex::a;
+		double c0 = v[0]->*channel;
+		double d1 = v[1]->*channel - c0;
+		double d2 = v[2]->*channel - c0;
+		base[c] = c0;
+		gradX[c] = clampDouble((d1 * ey2 - d2 * ey1) / cross, MaxColorStep);
+		gradY[c] = clampDouble((d2 * ex1 - d1 * ex2) / cross, MaxColorStep);
+	}
+
+	TriangleSpan span;
+	int32_t colorStepsY[4];
+	for (int c = 0; c < 4; ++c)
+	{
+		span.colorSteps[c] = toFixed(gradX[c]);
+		colorStepsY[c] = toFixed(gradY[c]);
+	}
+
+	for (int by = y0; by < y1; by += BlockSize)
+	{
+		int h = std::min(BlockSize, y1 - by);
+		for (int bx = x0; bx < x1; bx += BlockSize)
+		{
+			int w = std::min(BlockSize, x1 - bx);
+
+			// Each edge function is linear, so its extremes over the block
+			// are at the corners
+			bool outside = false;
+			int32_t edgeStepsY[3];
+			for (int k = 0; k < 3 && !outside; ++k)
+			{
+				const EdgeFunction &edge = edges[k];
+				int64_t corner = edge.origin + edge.stepX * bx + edge.stepY * by;
+				int64_t spreadX = edge.stepX * (w - 1);
+				int64_t spreadY = edge.stepY * (h - 1);
+				int64_t low = corner + std::min<int64_t>(spreadX, 0) + std::min<int64_t>(spreadY, 0);
+				int64_t high = corner + std::max<int64_t>(spreadX, 0) + std::max<int64_t>(spreadY, 0);
+
+				if (high < 0)
+					outside = true;
+				else if (low >= 0)
+				{
+					span.edges[k] = 0;
+					span.edgeSteps[k] = 0;
+					edgeStepsY[k] = 0;
+				}
+				else
+				{
+					span.edges[k] = int32_t(corner);
+					span.edgeSteps[k] = int32_t(edge.stepX);
+					edgeStepsY[k] = int32_t(edge.stepY);
+				}
+			}
+
+			if (outside)
+				continue;
+
+			double centerX = bx + 0.5 - originX;
+			double centerY = by + 0.5 - originY;
+			for (int c = 0; c < 4; ++c)
+				span.colors[c] = toFixed(clampDouble(base[c] + gradX[c] * centerX + gradY[c] * centerY, MaxColor));
+
+			for (int y = by; y < by + h; ++y)
+			{
+				kernels.triangleSpan(surface.row(y) + bx, w, span);
+
+				for (int k = 0; k < 3; ++k)
+					span.edges[k] += edgeStepsY[k];
+				for (int c = 0; c < 4; ++c)
+					span.colors[c] += colorStepsY[c];
+			}
+		}
+	}
+
+	IntRect result;
+	result.x = x0;
+	result.y = y0;
+	result.w = x1 - x0;
+	result.h = y1 - y0;
+	return result;
+}
+
+}
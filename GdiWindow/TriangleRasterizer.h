@@ -0,0 +1,29 @@
+#pragma once
+
+#include "GdiKernels.h"
+
+namespace GdiWindow
+{
+
+// A triangle corner in pixel coordinates with its premultiplied color,
+// 0-255 per channel
+struct RasterVertex
+{
+	float x = 0, y = 0;
+	float b = 0, g = 0, r = 0, a = 0;
+};
+
+// Half-space rasterizer. Corners snap to 1/16 pixel and pixels are covered
+// when their center is inside the triangle, so neighbouring triangles meet
+// without gaps or overlap: a pixel on an edge they share belongs to one of
+// them. The bounds are walked in 8x8 blocks classified by their corners:
+// blocks outside an edge are skipped and edges a block lies inside drop out
+// of its tests. Colors are interpolated incrementally along each row.
+struct TriangleRasterizer
+{
+	// Both windings are drawn. Returns the pixel bounds that may have
+	// changed, within clip.
+	static IntRect drawTriangle(const Surface &surface, const IntRect &clip, const RasterVertex vertices[3], const KernelTable &kernels);
+};
+
+}
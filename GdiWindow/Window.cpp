@@ -1,12 +1,18 @@
 #include "Window.h"
 
 #include "Guard.h"
+#include "Trace.h"
 
 #include <assert.h>
+#include <math.h>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <mutex>
 #include <thread>
 #include <map>
+#include <deque>
+#include <string>
 #include <vector>
 #include <cstdlib>
 #include <sstream>
@@ -16,15 +22,88 @@
 namespace GdiWindow
 {
 
+struct HandleName
+{
+	std::string name;
+	uint32_t number = 0;
+};
+
+// Id 0 is the default constructed handle. Names live in a deque so the
+// pointers handed out by getName stay valid as handles are added.
+struct HandleTable
+{
+	std::map<std::pair<std::string, uint32_t>, uint32_t> ids;
+	std::deque<HandleName> names;
+
+	HandleTable()
+	{
+		names.emplace_back();
+	}
+};
+
+static Ref<HandleTable> getHandleTable()
+{
+	static Guard<HandleTable> table;
+	return table;
+}
+
+WindowHandle::WindowHandle(const char *name, uint32_t number)
+{
+	Ref<HandleTable> table = getHandleTable();
+	std::pair<std::string, uint32_t> key(name, number);
+
+	auto it = table->ids.find(key);
+	if (it != table->ids.end())
+	{
+		id = it->second;
+		return;
+	}
+
+	id = uint32_t(table->names.size());
+	table->names.emplace_back();
+	table->names.back().name = key.first;
+	table->names.back().number = number;
+	table->ids[key] = id;
+}
+
+const char *WindowHandle::getName() const
+{
+	Ref<HandleTable> table = getHandleTable();
+	assert(id < table->names.size());
+	return table->names[id].name.c_str();
+}
+
+uint32_t WindowHandle::getNumber() const
+{
+	Ref<HandleTable> table = getHandleTable();
+	assert(id < table->names.size());
+	return table->names[id].number;
+}
+
+// Per-window state is kept in vectors or deques indexed by handle id
+template<typename Container>
+static typename Container::value_type &getSlot(Container &container, const WindowHandle &windowHandle)
+{
+	if (windowHandle.id >= container.size())
+		container.resize(windowHandle.id + 1);
+
+	return container[windowHandle.id];
+}
+
+static uint32_t getHandleId(HWND hwnd)
+{
+	return uint32_t(GetWindowLongPtrA(hwnd, GWLP_USERDATA));
+}
+
 struct OpenClose
 {
-	uint32_t open;
-	uint32_t close;
+	uint32_t open = 0;
+	uint32_t close = 0;
 };
 
 struct OpenCloseMap
 {
-	std::map<WindowHandle, OpenClose> map;
+	std::vector<OpenClose> map;
 };
 
 static Ref<OpenCloseMap> getOpenCloseMap()
@@ -44,28 +123,33 @@ struct DelegateState
 	MoveDelegate moveDelegate = nullptr;
 	ResizeDelegate resizeDelegate = nullptr;
 	MessageDelegate messageDelegate = nullptr;
+	VisibilityDelegate visibilityDelegate = nullptr;
 };
 
-static Ref<std::map<WindowHandle, DelegateState>> getDelegateStateMap()
+// A deque so growing it for a new handle never moves the other slots.
+// Delegates are called with the lock dropped while still holding a
+// Ref<DelegateState> to their slot.
+static Ref<std::deque<DelegateState>> getDelegateStateMap()
 {
-	static Guard<std::map<WindowHandle, DelegateState>> map;
+	static Guard<std::deque<DelegateState>> map;
 	return map;
 }
 
 static Ref<DelegateState> getDelegateState(const WindowHandle &windowHandle)
 {
-	Ref<std::map<WindowHandle, DelegateState>> map = getDelegateStateMap();
-	return stealMutex(map, map.t->operator[](windowHandle));
+	Ref<std::deque<DelegateState>> map = getDelegateStateMap();
+	return stealMutex(map, getSlot(*map.t, windowHandle));
 }
 
 static OptionalRef<DelegateState> tryFindDelegateStateWithHwnd(HWND hwnd)
 {
-	Ref<std::map<WindowHandle, DelegateState>> map = getDelegateStateMap();
-	for (auto it : *map.t)
-	{
-		if (it.second.hwnd == hwnd)
-			return stealMutexOptional(map, map->operator[](it.first));
-	}
+	uint32_t id = getHandleId(hwnd);
+	if (id == 0)
+		return OptionalRef<DelegateState>();
+
+	Ref<std::deque<DelegateState>> map = getDelegateStateMap();
+	if (id < map.t->size() && (*map.t)[id].hwnd == hwnd)
+		return stealMutexOptional(map, (*map.t)[id]);
 
 	return OptionalRef<DelegateState>();
 }
@@ -93,19 +177,66 @@ static void callDelegate(Ref<DelegateState> &state, DelegateType delegateObject,
 	}
 }
 
+static void callVisibilityDelegate(Ref<DelegateState> &state, HWND hwnd, bool visible)
+{
+	if (!state->visibilityDelegate)
+		return;
+
+	VisibilityDelegate visibilityDelegate = state->visibilityDelegate;
+	WindowHandle windowHandle = state->windowHandle;
+
+	InverseMutexGuard ig(*state.m);
+	TRACE_ZONE("Visibility delegate");
+	visibilityDelegate(windowHandle, hwnd, visible);
+}
+
+struct OpenWaiter
+{
+	WindowOpenedCallback onOpened;
+	void *context;
+};
+
+static void callOpenWaiters(const std::vector<OpenWaiter> &waiters)
+{
+	for (const OpenWaiter &waiter : waiters)
+		waiter.onOpened(waiter.context);
+}
+
 struct WindowThreadState
 {
+	bool active = false;
 	bool hasOpened = false;
 	bool isClosing = false;
 	bool closingSelf = false;
 	bool closingExternally = false;
 
+	// Set by Window::setRect and applied by the window thread
+	bool rectPending = false;
+	Rect pendingRect;
+
 	HWND hwnd = nullptr;
+
+	// From tryWaitForOpen, called once the window has opened or its state
+	// is deleted
+	std::vector<OpenWaiter> openWaiters;
 };
 
+// Thread states are only touched under the map lock, so deleting one never
+// has to wait for another thread to let go of it.
 struct WindowThreadStateMap
 {
-	std::map<WindowHandle, Guard<WindowThreadState> *> map;
+	std::vector<WindowThreadState> map;
+
+	// Notified when a window has opened or its state was deleted
+	std::condition_variable changed;
+
+	WindowThreadState *find(const WindowHandle &windowHandle)
+	{
+		if (windowHandle.id < map.size() && map[windowHandle.id].active)
+			return &map[windowHandle.id];
+
+		return nullptr;
+	}
 };
 
 static Ref<WindowThreadStateMap> getMap()
@@ -114,15 +245,22 @@ static Ref<WindowThreadStateMap> getMap()
 	return map;
 }
 
+static void waitForChange(Ref<WindowThreadStateMap> &map)
+{
+	std::unique_lock<std::mutex> lock(*map.m, std::adopt_lock);
+	map->changed.wait(lock);
+	lock.release();
+}
+
 static OptionalRef<WindowThreadState> tryFindWithHwnd(HWND hwnd)
 {
+	WindowHandle windowHandle;
+	windowHandle.id = getHandleId(hwnd);
+
 	Ref<WindowThreadStateMap> map = getMap();
-	for (auto it : map->map)
-	{
-		Ref<WindowThreadState> state = *it.second;
-		if (state->hwnd == hwnd)
-			return state;
-	}
+	WindowThreadState *state = map->find(windowHandle);
+	if (state && state->hwnd == hwnd)
+		return stealMutexOptional(map, *state);
 
 	return OptionalRef<WindowThreadState>();
 }
@@ -130,26 +268,120 @@ static OptionalRef<WindowThreadState> tryFindWithHwnd(HWND hwnd)
 static OptionalRef<WindowThreadState> tryGetState(const WindowHandle &windowHandle)
 {
 	Ref<WindowThreadStateMap> map = getMap();
-	auto it = map->map.find(windowHandle);
-	if (it != map->map.end())
-	{
-		return OptionalRef<WindowThreadState>(*it->second);
-	}
-	
+	if (WindowThreadState *state = map->find(windowHandle))
+		return stealMutexOptional(map, *state);
+
 	return OptionalRef<WindowThreadState>();
 }
 
 static Ref<WindowThreadState> getState(const WindowHandle &windowHandle)
 {
 	Ref<WindowThreadStateMap> map = getMap();
-	auto *ptr = map->map[windowHandle];
-	assert(ptr);
-	return *ptr;
+	WindowThreadState *state = map->find(windowHandle);
+	assert(state);
+	return stealMutex(map, *state);
+}
+
+// Posted to a window by Window::close to wake its message loop
+static UINT getCloseRequestMessage()
+{
+	static const UINT message = RegisterWindowMessageA("GdiWindowCloseRequest");
+	return message;
+}
+
+// Posted by Window::setRect when no reposition is pending yet
+static UINT getSetRectMessage()
+{
+	static const UINT message = RegisterWindowMessageA("GdiWindowSetRect");
+	return message;
+}
+
+// Outer window rect in screen coordinates, cached so that getRect needs no
+// lock and no OS call. Only the window's own thread writes it, guarded by a
+// seqlock; sequence is odd while a write is in progress.
+struct WindowGeometry
+{
+	std::atomic<uint32_t> sequence{ 0 };
+	std::atomic<int32_t> x{ 0 }, y{ 0 }, w{ 0 }, h{ 0 };
+};
+
+// Pages of geometry are allocated on first use and never freed, so readers
+// can index them without taking a lock.
+static const uint32_t GeometryPageBits = 8;
+static const uint32_t GeometryPageSize = 1 << GeometryPageBits;
+static const uint32_t GeometryPageCount = 1024;
+
+static std::atomic<WindowGeometry *> geometryPages[GeometryPageCount];
+static std::mutex geometryPageMutex;
+
+static WindowGeometry *findGeometry(uint32_t id)
+{
+	uint32_t page = id >> GeometryPageBits;
+	if (page >= GeometryPageCount)
+		return nullptr;
+
+	WindowGeometry *geometry = geometryPages[page].load(std::memory_order_acquire);
+	return geometry ? geometry + (id & (GeometryPageSize - 1)) : nullptr;
+}
+
+static WindowGeometry &getGeometry(uint32_t id)
+{
+	if (WindowGeometry *geometry = findGeometry(id))
+		return *geometry;
+
+	uint32_t page = id >> GeometryPageBits;
+	assert(page < GeometryPageCount && "Too many window handles");
+
+	std::lock_guard<std::mutex> lock(geometryPageMutex);
+	WindowGeometry *geometry = geometryPages[page].load(std::memory_order_relaxed);
+	if (!geometry)
+	{
+		geometry = new WindowGeometry[GeometryPageSize];
+		geometryPages[page].store(geometry, std::memory_order_release);
+	}
+
+	return geometry[id & (GeometryPageSize - 1)];
+}
+
+static void writeGeometry(uint32_t id, int32_t x, int32_t y, int32_t w, int32_t h)
+{
+	WindowGeometry &geometry = getGeometry(id);
+	uint32_t sequence = geometry.sequence.load(std::memory_order_relaxed);
+	geometry.sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	geometry.x.store(x, std::memory_order_relaxed);
+	geometry.y.store(y, std::memory_order_relaxed);
+	geometry.w.store(w, std::memory_order_relaxed);
+	geometry.h.store(h, std::memory_order_relaxed);
+
+	geometry.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+static void updateGeometry(HWND hwnd)
+{
+	uint32_t id = getHandleId(hwnd);
+	RECT rect;
+	if (id != 0 && GetWindowRect(hwnd, &rect))
+		writeGeometry(id, rect.left, rect.top, rect.right - rect.left, rect.bottom - rect.top);
+}
+
+static bool isCloseRequested(const WindowHandle &windowHandle)
+{
+	Ref<OpenCloseMap> openCloseMap = getOpenCloseMap();
+	OpenClose &openClose = getSlot(openCloseMap->map, windowHandle);
+	return openClose.open <= openClose.close;
 }
 
 LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
 {
+	TRACE_ZONE("WndProc");
 	int64_t result = 0;
+
+	// Before the delegates run so they already see the new rect
+	if (msg == WM_MOVE || msg == WM_SIZE)
+		updateGeometry(hwnd);
+
 	if (OptionalRef<DelegateState> delegateStateOptional = tryFindDelegateStateWithHwnd(hwnd))
 	{
 		Ref<DelegateState> delegateState = dereferenceAndEat(delegateStateOptional);
@@ -159,6 +391,7 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
 			MessageDelegate messageDelegate = delegateState->messageDelegate;
 			WindowHandle windowHandle = delegateState->windowHandle;
 			InverseMutexGuard ig(*delegateState.m);
+			TRACE_ZONE("Message delegate");
 			messageDelegate(windowHandle, hwnd, msg, wParam, lParam);
 		}
 		
@@ -166,6 +399,7 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
 		{
 			if (msg == WM_PAINT)
 			{
+				TRACE_ZONE("Paint delegate");
 				if (delegateState->paintDelegate)
 					callDelegate(delegateState, delegateState->paintDelegate);
 
@@ -173,11 +407,20 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
 			}
 			else if (msg == WM_MOVE)
 			{
+				TRACE_ZONE("Move delegate");
 				if (delegateState->moveDelegate)
 					callDelegate(delegateState, delegateState->moveDelegate);
 			}
+			else if (msg == WM_SHOWWINDOW)
+			{
+				callVisibilityDelegate(delegateState, hwnd, wParam != 0);
+			}
 			else if (msg == WM_SIZE)
 			{
+				if (wParam == SIZE_MINIMIZED || wParam == SIZE_RESTORED || wParam == SIZE_MAXIMIZED)
+					callVisibilityDelegate(delegateState, hwnd, wParam != SIZE_MINIMIZED);
+
+				TRACE_ZONE("Resize delegate");
 				if (delegateState->resizeDelegate)
 					callDelegate(delegateState, delegateState->resizeDelegate);
 			}
@@ -206,29 +449,18 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
 	return result;
 }
 
-static HWND openWindow(const std::string &titleParam)
-{
-	static uint64_t counter = 0;
-	std::ostringstream classNameTemp;
-	classNameTemp << titleParam << "___" << ++counter;
-	
-	std::string classNameTemp2 = classNameTemp.str();
-	const char *title = titleParam.c_str();
-	const char *className = classNameTemp2.c_str();
-
-	//wchar_t title[512];
-	//wchar_t className[512];
-	//mbstowcs_s(nullptr, className, classNameTemp.str().c_str(), 512);
-	//mbstowcs_s(nullptr, title, titleParam.c_str(), 512);
+static const char *WindowClassName = "GdiWindow";
 
+// One class serves every window so opening does not register a new one
+static bool registerWindowClass()
+{
 	HINSTANCE hInstance = GetModuleHandle(NULL);
 	if (!hInstance)
 	{
 		assert(!"No hInstance");
-		return nullptr;
+		return false;
 	}
 
-	// Registering the Window Class
 	WNDCLASSEXA wc;
 	wc.cbSize = sizeof(WNDCLASSEXA);
 	wc.style = 0;
@@ -240,23 +472,32 @@ static HWND openWindow(const std::string &titleParam)
 	wc.hCursor = LoadCursor(NULL, IDC_ARROW);
 	wc.hbrBackground = (HBRUSH)(COLOR_WINDOW + 1);
 	wc.lpszMenuName = NULL;
-	wc.lpszClassName = className;
+	wc.lpszClassName = WindowClassName;
 	wc.hIconSm = LoadIcon(NULL, IDI_APPLICATION);
 
 	if (!RegisterClassExA(&wc))
 	{
 		assert(!"Window Registration Failed!");
-		return nullptr;
+		return false;
 	}
 
+	return true;
+}
+
+static HWND openWindow(const std::string &titleParam, const WindowHandle &windowHandle)
+{
+	static const bool registered = registerWindowClass();
+	if (!registered)
+		return nullptr;
+
 	// Creating the Window
 	HWND hwnd = CreateWindowExA(
 		WS_EX_CLIENTEDGE,
-		className,
-		title,
+		WindowClassName,
+		titleParam.c_str(),
 		WS_OVERLAPPEDWINDOW,
 		CW_USEDEFAULT, CW_USEDEFAULT, 240, 120,
-		NULL, NULL, hInstance, NULL);
+		NULL, NULL, GetModuleHandle(NULL), NULL);
 
 	if (hwnd == NULL)
 	{
@@ -264,6 +505,10 @@ static HWND openWindow(const std::string &titleParam)
 		return nullptr;
 	}
 
+	// Lets WndProc find the window's state without searching
+	SetWindowLongPtrA(hwnd, GWLP_USERDATA, LONG_PTR(windowHandle.id));
+	updateGeometry(hwnd);
+
 	int nCmdShow = SW_SHOWNORMAL;
 
 	ShowWindow(hwnd, nCmdShow);
@@ -272,14 +517,34 @@ static HWND openWindow(const std::string &titleParam)
 	return hwnd;
 }
 
+static void applyPendingRect(const WindowHandle &windowHandle, HWND hwnd)
+{
+	Rect rect;
+	{
+		Ref<WindowThreadState> state = getState(windowHandle);
+		if (!state->rectPending)
+			return;
+
+		rect = state->pendingRect;
+		state->rectPending = false;
+	}
+
+	// WM_MOVE and WM_SIZE from this update the cached geometry
+	SetWindowPos(hwnd, NULL, int(lroundf(rect.pos.x)), int(lroundf(rect.pos.y)),
+		int(lroundf(rect.size.x)), int(lroundf(rect.size.y)), SWP_NOZORDER | SWP_NOACTIVATE);
+}
+
 static void deleteState(const WindowHandle &windowHandle)
 {
-	Ref<WindowThreadStateMap> map = getMap();
-	Guard<WindowThreadState> *statePtr = map->map[windowHandle];
-	map->map.erase(windowHandle);
-	statePtr->m.lock();
-	statePtr->m.unlock();
-	delete statePtr;
+	std::vector<OpenWaiter> waiters;
+	{
+		Ref<WindowThreadStateMap> map = getMap();
+		waiters.swap(map->map[windowHandle.id].openWaiters);
+		map->map[windowHandle.id] = WindowThreadState();
+		map->changed.notify_all();
+	}
+
+	callOpenWaiters(waiters);
 }
 
 static void windowThread(WindowHandle windowHandle)
@@ -288,81 +553,89 @@ static void windowThread(WindowHandle windowHandle)
 
 	{
 		std::ostringstream title;
-		title << windowHandle.name;
-		if (windowHandle.number > 0)
-			title << " " << windowHandle.number;
+		title << windowHandle.getName();
+		if (windowHandle.getNumber() > 0)
+			title << " " << windowHandle.getNumber();
 
-		hwnd = openWindow(title.str());
+		Trace::setThreadName(title.str().c_str());
+
+		hwnd = openWindow(title.str(), windowHandle);
 		if (!hwnd)
 		{
 			deleteState(windowHandle);
 			return;
 		}
 
-		Ref<WindowThreadStateMap> map = getMap();
-		Ref<WindowThreadState> state = *map->map[windowHandle];
-		state->hasOpened = true;
-		state->hwnd = hwnd;
+		std::vector<OpenWaiter> waiters;
+		{
+			Ref<WindowThreadStateMap> map = getMap();
+			WindowThreadState *state = map->find(windowHandle);
+			state->hasOpened = true;
+			state->hwnd = hwnd;
+			waiters.swap(state->openWaiters);
+			map->changed.notify_all();
+		}
+
+		callOpenWaiters(waiters);
 	}
 
 	{
 		Ref<DelegateState> state = getDelegateState(windowHandle);
 		state->windowHandle = windowHandle;
 		state->hwnd = hwnd;
+		TRACE_ZONE("Started delegate");
 		callDelegate(state, state->startedDelegate);
 	}
 
-	while (true)
+	// A close or setRect that came in before hwnd was published did not
+	// post a message
+	bool closingRequested = isCloseRequested(windowHandle);
+	applyPendingRect(windowHandle, hwnd);
+
+	// Message loop. Sleeps in GetMessage until there is input, a close
+	// request from Window::close or the quit posted by WM_DESTROY.
+	MSG msg;
+	while (!closingRequested && GetMessage(&msg, NULL, 0, 0) > 0)
 	{
-		// Message loop
-		MSG msg;
-		while (PeekMessage(&msg, hwnd, 0, 0, 0) != 0)
+		if (msg.hwnd == hwnd && msg.message == getCloseRequestMessage())
 		{
-			if (GetMessage(&msg, hwnd, 0, 0) > 0)
-			{
-				TranslateMessage(&msg);
-				DispatchMessage(&msg);
-			}
+			// The window may have been opened again since the request
+			closingRequested = isCloseRequested(windowHandle);
+			continue;
 		}
 
-		sleep(10);
-
-		bool closingRequested = false;
+		if (msg.hwnd == hwnd && msg.message == getSetRectMessage())
 		{
-			Ref<OpenCloseMap> openCloseMap = getOpenCloseMap();
-			OpenClose &openClose = openCloseMap->map[windowHandle];
-			if (openClose.open <= openClose.close)
-				closingRequested = true;
+			applyPendingRect(windowHandle, hwnd);
+			continue;
 		}
 
-		bool willClose = false;
-		
+		TranslateMessage(&msg);
+		DispatchMessage(&msg);
+	}
+
+	bool closingSelf = false;
+	{
+		Ref<WindowThreadState> state = getState(windowHandle);
+		closingSelf = state->closingSelf;
+		if (!closingSelf)
 		{
-			Ref<WindowThreadState> state = getState(windowHandle);
-			if (state->closingSelf)
-			{
-				willClose = true;
-			}
-			else if (closingRequested)
-			{
-				state->closingExternally = true;
-				state->isClosing = true;
-				willClose = true;
-			}
+			state->closingExternally = true;
+			state->isClosing = true;
 		}
-
-		if (willClose)
-			break;
 	}
 
 	{
 		Ref<DelegateState> state = getDelegateState(windowHandle);
+		TRACE_ZONE("Stopping delegate");
 		callDelegate(state, state->stoppingDelegate, false);
 		state->hwnd = nullptr;
 	}
 
-	CloseWindow(hwnd);
+	if (!closingSelf)
+		DestroyWindow(hwnd);
 
+	writeGeometry(windowHandle.id, 0, 0, 0, 0);
 	deleteState(windowHandle);
 }
 
@@ -372,7 +645,7 @@ void Window::open(const WindowHandle &windowHandle)
 	bool mightAlreadyBeOpen = false;
 	{
 		Ref<OpenCloseMap> openCloseMap = getOpenCloseMap();
-		OpenClose &openClose = openCloseMap->map[windowHandle];
+		OpenClose &openClose = getSlot(openCloseMap->map, windowHandle);
 		openClose.open += 1;
 		if (openClose.open <= openClose.close)
 		{
@@ -392,70 +665,87 @@ void Window::open(const WindowHandle &windowHandle)
 
 	Ref<WindowThreadStateMap> map = getMap();
 
+	// Wait until the previous instance of this window is closed
+	while (WindowThreadState *existing = map->find(windowHandle))
 	{
-		// Wait until the previous instance of this window is closed
-		uint32_t wait = 1;
-		while (1)
-		{
-			auto it = map->map.find(windowHandle);
-			if (it == map->map.end())
-				break;
+		if (mightAlreadyBeOpen && !existing->isClosing)
+			return;
 
+		assert(mightAlreadyBeOpen || existing->isClosing);
+		waitForChange(map);
+	}
 
-			if (mightAlreadyBeOpen)
-			{
-				Ref<WindowThreadState> windowThreadState = *it->second;
-				if (!windowThreadState->isClosing)
-					return;
-			}
-			else
-			{
-				assert((*it->second)->isClosing);
-			}
+	getSlot(map->map, windowHandle).active = true;
+	std::thread(windowThread, windowHandle).detach();
+}
+
+void Window::close(const WindowHandle &windowHandle)
+{
+	{
+		Ref<OpenCloseMap> openCloseMap = getOpenCloseMap();
+		getSlot(openCloseMap->map, windowHandle).close += 1;
+	}
 
-			map.m->unlock();
+	// The window thread checks the counts again after publishing hwnd, so
+	// a window that has no hwnd yet still sees this close
+	HWND hwnd = nullptr;
+	if (OptionalRef<WindowThreadState> state = tryGetState(windowHandle))
+		hwnd = state->hwnd;
 
-			sleep(wait);
-			wait++;
+	if (hwnd)
+		PostMessageA(hwnd, getCloseRequestMessage(), 0, 0);
+}
 
-			map.m->lock();
-		}
+void *Window::waitForOpen(const WindowHandle &windowHandle)
+{
+	Ref<WindowThreadStateMap> map = getMap();
+	while (WindowThreadState *state = map->find(windowHandle))
+	{
+		if (state->hasOpened)
+			return state->hwnd;
+
+		waitForChange(map);
 	}
 
-	Guard<WindowThreadState> *statePtr = new Guard<WindowThreadState>;
-	Ref<WindowThreadState> state = *statePtr;
-	map->map[windowHandle] = statePtr;
-	std::thread(windowThread, windowHandle).detach();
+	return nullptr;
 }
 
-void Window::close(const WindowHandle &windowHandle)
+bool Window::tryWaitForOpen(const WindowHandle &windowHandle, WindowOpenedCallback onOpened, void *context)
 {
-	Ref<OpenCloseMap> openCloseMap = getOpenCloseMap();
-	openCloseMap->map[windowHandle].close += 1;
+	Ref<WindowThreadStateMap> map = getMap();
+	WindowThreadState *state = map->find(windowHandle);
+	if (!state || state->hasOpened)
+		return true;
+
+	state->openWaiters.push_back(OpenWaiter{ onOpened, context });
+	return false;
+}
+
+void Window::waitForClose(const WindowHandle &windowHandle)
+{
+	Ref<WindowThreadStateMap> map = getMap();
+	while (map->find(windowHandle))
+		waitForChange(map);
 }
 
 bool Window::isOpen(const WindowHandle &windowHandle)
 {
 	Ref<OpenCloseMap> openCloseMap = getOpenCloseMap();
-	OpenClose &openClose = openCloseMap->map[windowHandle];
+	OpenClose &openClose = getSlot(openCloseMap->map, windowHandle);
 	return openClose.open > openClose.close;
 }
 
 bool Window::exists(const WindowHandle &windowHandle)
 {
 	Ref<WindowThreadStateMap> map = getMap();
-	return map->map.find(windowHandle) != map->map.end();
+	return map->find(windowHandle) != nullptr;
 }
 
 void *Window::getHwnd(const WindowHandle &windowHandle)
 {
 	Ref<WindowThreadStateMap> map = getMap();
-	auto it = map->map.find(windowHandle);
-	if (it != map->map.end())
-	{
-		Ref<WindowThreadState> windowThreadState = *it->second;
-		return windowThreadState->hwnd;
-	}
+	if (WindowThreadState *state = map->find(windowHandle))
+		return state->hwnd;
 
 	return nullptr;
 }
@@ -475,12 +765,50 @@ void Window::repaint(const WindowHandle& windowHandle)
 
 void Window::setRect(const WindowHandle &windowHandle, Rect rect)
 {
+	HWND hwnd = nullptr;
+	bool post = false;
+	{
+		OptionalRef<WindowThreadState> state = tryGetState(windowHandle);
+		if (!state)
+			return;
+
+		// Requests made before the window thread gets to the first one only
+		// replace the rect, so a burst ends up as one SetWindowPos
+		state->pendingRect = rect;
+		post = !state->rectPending;
+		state->rectPending = true;
+		hwnd = state->hwnd;
+	}
 
+	if (post && hwnd)
+		PostMessageA(hwnd, getSetRectMessage(), 0, 0);
 }
 
 Rect Window::getRect(const WindowHandle &windowHandle)
 {
-	return Rect();
+	WindowGeometry *geometry = findGeometry(windowHandle.id);
+	if (!geometry)
+		return Rect();
+
+	while (true)
+	{
+		uint32_t sequence = geometry->sequence.load(std::memory_order_acquire);
+		if (sequence & 1)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		Rect rect;
+		rect.pos.x = float(geometry->x.load(std::memory_order_relaxed));
+		rect.pos.y = float(geometry->y.load(std::memory_order_relaxed));
+		rect.size.x = float(geometry->w.load(std::memory_order_relaxed));
+		rect.size.y = float(geometry->h.load(std::memory_order_relaxed));
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (geometry->sequence.load(std::memory_order_relaxed) == sequence)
+			return rect;
+	}
 }
 
 void Window::registerStartedDelegate(const WindowHandle &windowHandle, StartedDelegate func)
@@ -513,5 +841,10 @@ void Window::registerMessageDelegate(const WindowHandle &windowHandle, MessageDe
 	getDelegateState(windowHandle)->messageDelegate = func;
 }
 
+void Window::registerVisibilityDelegate(const WindowHandle &windowHandle, VisibilityDelegate func)
+{
+	getDelegateState(windowHandle)->visibilityDelegate = func;
+}
+
 }
 
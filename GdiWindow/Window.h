@@ -1,24 +1,26 @@
 #pragma once
 
-#include <string>
 #include <inttypes.h>
 #include "GdiTypes.h"
 
 namespace GdiWindow
 {
 
+// Names a window. Constructing a handle interns the name and number once;
+// after that handles are compared, copied and looked up as a plain integer.
 struct WindowHandle
 {
-	std::string name;
-	uint32_t number;
+	uint32_t id = 0;
 
 	WindowHandle() {}
-	WindowHandle(const char *name, uint32_t number = 0) : name(name), number(number) {}
+	WindowHandle(const char *name, uint32_t number = 0);
 
-	bool operator<(const WindowHandle &o) const
-	{
-		return name < o.name || name == o.name && number < o.number;
-	}
+	const char *getName() const;
+	uint32_t getNumber() const;
+
+	bool operator<(const WindowHandle &o) const { return id < o.id; }
+	bool operator==(const WindowHandle &o) const { return id == o.id; }
+	bool operator!=(const WindowHandle &o) const { return id != o.id; }
 };
 
 typedef void(*StartedDelegate)(const WindowHandle &windowHandle, void *hwnd);
@@ -26,7 +28,9 @@ typedef void(*StoppingDelegate)(const WindowHandle &windowHandle, void *hwnd);
 typedef void(*PaintDelegate)(const WindowHandle &windowHandle, void *hwnd);
 typedef void(*MoveDelegate)(const WindowHandle &windowHandle, void *hwnd);
 typedef void(*ResizeDelegate)(const WindowHandle &windowHandle, void* hwnd);
+typedef void(*VisibilityDelegate)(const WindowHandle &windowHandle, void *hwnd, bool visible);
 typedef int64_t(*MessageDelegate)(const WindowHandle &windowHandle, void *hwnd, uint32_t msg, uint64_t wParam, int64_t lParam);
+typedef void(*WindowOpenedCallback)(void *context);
 
 struct Window
 {
@@ -36,8 +40,24 @@ struct Window
 	static bool exists(const WindowHandle &windowHandle);
 	static void *getHwnd(const WindowHandle &windowHandle);
 
+	// Block until the window has been created or closed, and return its hwnd
+	// or nullptr if it is not open
+	static void *waitForOpen(const WindowHandle &windowHandle);
+
+	// waitForOpen without blocking. Returns true if the window has already
+	// been created or is not open. Otherwise returns false and calls onOpened
+	// once from the window's thread when it has been created or closed;
+	// getHwnd tells which.
+	static bool tryWaitForOpen(const WindowHandle &windowHandle, WindowOpenedCallback onOpened, void *context);
+
+	// Block until the window's thread has finished
+	static void waitForClose(const WindowHandle &windowHandle);
+
 	static void repaint(const WindowHandle &windowHandle);
 
+	// Outer window rect in screen coordinates. setRect is applied by the
+	// window's thread, and requests made before it gets to them are merged
+	// into one move. getRect reads a cached copy and is cheap to call often.
 	static void setRect(const WindowHandle &windowHandle, Rect rect);
 	static Rect getRect(const WindowHandle &windowHandle);
 
@@ -47,6 +67,10 @@ struct Window
 	static void registerMoveDelegate(const WindowHandle &windowHandle, MoveDelegate func);
 	static void registerResizeDelegate(const WindowHandle& windowHandle, ResizeDelegate func);
 	static void registerMessageDelegate(const WindowHandle &windowHandle, MessageDelegate func);
+
+	// Called when the window is shown, hidden, minimized or restored, before
+	// the resize delegate of the same change
+	static void registerVisibilityDelegate(const WindowHandle &windowHandle, VisibilityDelegate func);
 };
 
 }
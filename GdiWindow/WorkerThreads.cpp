@@ -0,0 +1,25 @@
+#include "WorkerThreads.h"
+
+#include <thread>
+
+namespace GdiWindow
+{
+
+int WorkerThreads::getPoolSize(int minimum, int maximum)
+{
+	unsigned cores = std::thread::hardware_concurrency();
+	int size = cores < 2 ? minimum : int(cores - 1);
+	return size < minimum ? minimum : size > maximum ? maximum : size;
+}
+
+void WorkerThreads::start(bool &started, int count, void (*run)())
+{
+	if (started)
+		return;
+
+	started = true;
+	for (int i = 0; i < count; ++i)
+		std::thread(run).detach();
+}
+
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "Guard.h"
+
+namespace GdiWindow
+{
+
+// Background threads that wait on a queue for the rest of the process. They
+// are started on first use and detached, never joined, so the state they
+// wait on is never destroyed either.
+struct WorkerThreads
+{
+	// Threads for a pool that shares the cores with the thread feeding it:
+	// one less than the cores, within minimum and maximum
+	static int getPoolSize(int minimum, int maximum);
+
+	// Starts count threads running run unless started is already set. Call
+	// with the lock of the state they wait on held.
+	static void start(bool &started, int count, void (*run)());
+};
+
+// The state of a set of worker threads, one per type
+template<typename T>
+Guard<T> &getWorkerState()
+{
+	static Guard<T> *state = new Guard<T>;
+	return *state;
+}
+
+}